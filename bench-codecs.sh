@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compare ingest throughput and on-disk size of the loose object codecs.
+#
+# A synthetic corpus (text, source-like and random binary files) is staged
+# with update-index into a fresh repository for each codec/level.
+#
+# usage: ./bench-codecs.sh [corpus size in MiB]
+
+set -e
+
+SIZE_MB=${1:-64}
+GT=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+corpus="$WORK/corpus"
+mkdir -p "$corpus"
+
+# a third of the corpus each: numbers, repetitive text and random bytes
+files=$((SIZE_MB * 4))
+i=0
+while [ $i -lt $files ]; do
+	case $((i % 3)) in
+	0) seq $((i * 1000)) $((i * 1000 + 30000)) | head -c 262144 ;;
+	1) yes "static int object_writer_init(struct object_writer *writer, $i);" |
+		head -c 262144 ;;
+	2) head -c 262144 /dev/urandom ;;
+	esac > "$corpus/file$i"
+	i=$((i + 1))
+done
+input_bytes=$(cat "$corpus"/* | wc -c)
+
+printf "%-10s %10s %12s %10s\n" codec seconds "MiB/s" "size KiB"
+for config in stored zlib:1 zlib:6 zlib:9; do
+	codec=${config%%:*}
+	level=${config#*:}
+	[ "$level" = "$config" ] && level=-1
+
+	repo="$WORK/repo-$codec-$level"
+	mkdir -p "$repo/objects"
+
+	start=$(date +%s.%N)
+	(cd "$corpus" && GT_DIRECTORY="$repo" GT_CODEC=$codec GT_COMPRESSION=$level \
+		"$GT/update-index" --add -- * > /dev/null)
+	end=$(date +%s.%N)
+
+	size=$(du -sk "$repo/objects" | cut -f1)
+	echo "$config $start $end $size" | awk -v bytes="$input_bytes" '{
+		seconds = $3 - $2;
+		printf "%-10s %10.3f %12.1f %10d\n", $1, seconds,
+			bytes / 1048576 / seconds, $4 }'
+done
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "buffer.h"
+#include "index.h"
 
 static int buffer_grow(struct buffer *buffer, size_t needed)
 {
@@ -89,3 +90,19 @@ int buffer_seek(struct buffer *buffer, int offset)
 
 	return 0;
 }
+
+int buffer_flush(struct buffer *buffer, size_t threshold)
+{
+	char *error;
+
+	if (buffer->data_bytes < threshold)
+		return 0;
+	if (exact_write(1, buffer->data, buffer->data_bytes, &error) < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return -1;
+	}
+	buffer->data_bytes = 0;
+
+	return 0;
+}
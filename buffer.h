@@ -10,6 +10,9 @@ struct buffer {
 	size_t allocated;
 };
 
+/* output is written out by chunks of about that size */
+#define BUFFER_FLUSH_BYTES	(1024 * 1024)
+
 #define DECLARE_BUFFER(_b) \
 	struct buffer _b = { .data = NULL, .data_bytes = 0, .allocated = 0 }
 
@@ -21,4 +24,8 @@ int buffer_sprintf(struct buffer *buffer, const char *fmt, ...);
 
 int buffer_seek(struct buffer *buffer, int offset);
 
+/* Write out to stdout what was buffered, once there are threshold bytes.
+ * Errors are reported on stderr. */
+int buffer_flush(struct buffer *buffer, size_t threshold);
+
 #endif /* BUFFER_H */
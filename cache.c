@@ -0,0 +1,245 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "config.h"
+#include "index.h"
+
+/* Objects are chained in a hash table indexed by the first bytes of their
+ * sha1 (which are already uniformly distributed) and in a list from the most
+ * to the least recently used. */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	size_t budget;
+	struct cached_object **buckets;
+	size_t buckets_count;
+	struct cached_object *lru_head;
+	struct cached_object *lru_tail;
+	struct object_cache_stats stats;
+} cache = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void cache_init(void)
+{
+	int mib;
+
+	mib = config_get_int("core.objectcache", "GT_OBJECT_CACHE",
+			OBJECT_CACHE_DEFAULT_MIB);
+	cache.budget = mib > 0 ? (size_t) mib * 1024 * 1024 : 0;
+}
+
+static size_t cache_bucket(const uint8_t *sha1)
+{
+	uint32_t h;
+
+	memcpy(&h, sha1, sizeof(h));
+	return h & (cache.buckets_count - 1);
+}
+
+static void lru_unlink(struct cached_object *object)
+{
+	if (object->lru_prev)
+		object->lru_prev->lru_next = object->lru_next;
+	else
+		cache.lru_head = object->lru_next;
+	if (object->lru_next)
+		object->lru_next->lru_prev = object->lru_prev;
+	else
+		cache.lru_tail = object->lru_prev;
+	object->lru_prev = object->lru_next = NULL;
+}
+
+static void lru_push(struct cached_object *object)
+{
+	object->lru_prev = NULL;
+	object->lru_next = cache.lru_head;
+	if (cache.lru_head)
+		cache.lru_head->lru_prev = object;
+	else
+		cache.lru_tail = object;
+	cache.lru_head = object;
+}
+
+static struct cached_object *cache_lookup(uint8_t *sha1)
+{
+	struct cached_object *object;
+
+	if (!cache.buckets_count)
+		return NULL;
+	for (object = cache.buckets[cache_bucket(sha1)]; object;
+			object = object->hash_next) {
+		if (!memcmp(object->sha1, sha1, 20))
+			return object;
+	}
+
+	return NULL;
+}
+
+static void cache_free(struct cached_object *object)
+{
+	free((void *) object->data);
+	free(object);
+}
+
+static void cache_remove(struct cached_object *object)
+{
+	struct cached_object **p;
+
+	for (p = &cache.buckets[cache_bucket(object->sha1)]; *p;
+			p = &(*p)->hash_next) {
+		if (*p == object) {
+			*p = object->hash_next;
+			break;
+		}
+	}
+	lru_unlink(object);
+	object->cached = 0;
+	cache.stats.entries--;
+	cache.stats.bytes -= object->bytes;
+}
+
+/* Drop unused objects from the tail until the cache fits its budget */
+static void cache_trim(void)
+{
+	struct cached_object *object, *prev;
+
+	for (object = cache.lru_tail; object && cache.stats.bytes > cache.budget;
+			object = prev) {
+		prev = object->lru_prev;
+		if (object->refs)
+			continue;
+		cache_remove(object);
+		cache_free(object);
+		cache.stats.evictions++;
+	}
+}
+
+/* Keep about one bucket per object */
+static void cache_grow(void)
+{
+	struct cached_object **buckets, *object, *next;
+	size_t count, old_count, i;
+
+	if (cache.stats.entries < cache.buckets_count)
+		return;
+
+	count = cache.buckets_count ? cache.buckets_count * 2 : 256;
+	buckets = calloc(count, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	old_count = cache.buckets_count;
+	cache.buckets_count = count;
+	for (i = 0; i < old_count; i++) {
+		for (object = cache.buckets[i]; object; object = next) {
+			size_t bucket = cache_bucket(object->sha1);
+
+			next = object->hash_next;
+			object->hash_next = buckets[bucket];
+			buckets[bucket] = object;
+		}
+	}
+	free(cache.buckets);
+	cache.buckets = buckets;
+}
+
+static void cache_insert(struct cached_object *object)
+{
+	size_t bucket;
+
+	cache_grow();
+	if (!cache.buckets_count)
+		return;
+
+	bucket = cache_bucket(object->sha1);
+	object->hash_next = cache.buckets[bucket];
+	cache.buckets[bucket] = object;
+	lru_push(object);
+	object->cached = 1;
+	cache.stats.entries++;
+	cache.stats.bytes += object->bytes;
+}
+
+const struct cached_object *object_cache_get(uint8_t *sha1, char **error)
+{
+	struct cached_object *object;
+	struct cached_object *found;
+	uint8_t *data;
+
+	pthread_once(&cache.once, cache_init);
+
+	pthread_mutex_lock(&cache.lock);
+	object = cache_lookup(sha1);
+	if (object) {
+		object->refs++;
+		lru_unlink(object);
+		lru_push(object);
+		cache.stats.hits++;
+		pthread_mutex_unlock(&cache.lock);
+		return object;
+	}
+	cache.stats.misses++;
+	pthread_mutex_unlock(&cache.lock);
+
+	/* inflate without holding the lock */
+	object = calloc(1, sizeof(*object));
+	if (!object) {
+		asprintf(error, "calloc fail: %m");
+		return NULL;
+	}
+	data = object_read(sha1, object->type, &object->bytes, error);
+	if (!data) {
+		free(object);
+		return NULL;
+	}
+	memcpy(object->sha1, sha1, 20);
+	object->data = data;
+	object->refs = 1;
+
+	pthread_mutex_lock(&cache.lock);
+	/* another thread may have read it meanwhile */
+	found = cache_lookup(sha1);
+	if (found) {
+		found->refs++;
+		pthread_mutex_unlock(&cache.lock);
+		cache_free(object);
+		return found;
+	}
+	/* objects bigger than the whole cache are only handed out */
+	if (cache.budget && object->bytes <= cache.budget) {
+		cache_insert(object);
+		cache_trim();
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return object;
+}
+
+void object_cache_put(const struct cached_object *object)
+{
+	struct cached_object *entry = (struct cached_object *) object;
+
+	if (!entry)
+		return;
+
+	pthread_mutex_lock(&cache.lock);
+	entry->refs--;
+	if (entry->refs == 0) {
+		if (!entry->cached)
+			cache_free(entry);
+		else if (cache.stats.bytes > cache.budget)
+			cache_trim();
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void object_cache_stats(struct object_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache.lock);
+	*stats = cache.stats;
+	pthread_mutex_unlock(&cache.lock);
+}
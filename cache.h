@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "index.h"
+
+/* Inflated objects are kept in a process wide cache, so that reading the
+ * same object again costs a hash table lookup. Its size is bounded by
+ * core.objectcache (GT_OBJECT_CACHE) MiB, 64 by default, 0 disables it: the
+ * least recently used objects are dropped first.
+ *
+ * object_cache_get() hands out a read-only object holding a reference, which
+ * is given back with object_cache_put(). Objects in use are never dropped.
+ * All of it is thread-safe, reading objects included: the delta base cache
+ * of the packs has its own lock. */
+
+#define OBJECT_CACHE_DEFAULT_MIB	64
+
+struct cached_object {
+	uint8_t sha1[20];
+	char type[OBJECT_TYPE_BYTES];
+	const uint8_t *data;
+	uint64_t bytes;
+
+	/* owned by the cache */
+	int refs;
+	int cached;
+	struct cached_object *hash_next;
+	struct cached_object *lru_prev;
+	struct cached_object *lru_next;
+};
+
+struct object_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;
+};
+
+const struct cached_object *object_cache_get(uint8_t *sha1, char **error);
+void object_cache_put(const struct cached_object *object);
+
+void object_cache_stats(struct object_cache_stats *stats);
+
+#endif /* CACHE_H */
@@ -2,9 +2,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "index.h"
 
+/* stdout buffer of the batch modes */
+#define BATCH_OUTPUT_BYTES	(1024 * 1024)
+
 static int usage(const char *program,
 		int return_value,
 		const char *message, ...)
@@ -17,32 +21,130 @@ static int usage(const char *program,
 		va_end(ap);
 		fprintf(stderr, "\n");
 	}
-	fprintf(stderr, "usage: %s <sha1>...\n", program);
+	fprintf(stderr, "usage: %s [--help|-h] (--batch|--batch-check|[-t|-s] <sha1>)\n", program);
 
 	return return_value;
 }
 
+/* One object id per line on stdin, "<sha1> <type> <size>\n" then, unless
+ * check_only, the content followed by a newline on stdout, as git does.
+ * Unknown or invalid ids give "<input> missing\n". */
+static int batch(int check_only)
+{
+	struct object_reader reader;
+	char *line;
+	size_t line_allocated;
+	ssize_t line_bytes;
+	char *output;
+
+	output = malloc(BATCH_OUTPUT_BYTES);
+	if (output)
+		setvbuf(stdout, output, _IOFBF, BATCH_OUTPUT_BYTES);
+
+	object_reader_init(&reader);
+	line = NULL;
+	line_allocated = 0;
+	while ((line_bytes = getline(&line, &line_allocated, stdin)) >= 0) {
+		char type[OBJECT_TYPE_BYTES];
+		uint8_t sha1[20];
+		uint8_t *buffer;
+		uint64_t buffer_bytes;
+		char *error;
+
+		if (line_bytes > 0 && line[line_bytes - 1] == '\n')
+			line[--line_bytes] = '\0';
+
+		if (hex2sha1(line, sha1) < 0) {
+			fprintf(stdout, "%s missing\n", line);
+			continue;
+		}
+
+		if (check_only) {
+			if (object_info(sha1, type, &buffer_bytes, &error) < 0) {
+				free(error);
+				fprintf(stdout, "%s missing\n", line);
+				continue;
+			}
+			fprintf(stdout, "%s %s %lu\n", line, type, buffer_bytes);
+			continue;
+		}
+
+		buffer = object_reader_read(&reader, sha1, type, &buffer_bytes, &error);
+		if (!buffer) {
+			free(error);
+			fprintf(stdout, "%s missing\n", line);
+			continue;
+		}
+
+		fprintf(stdout, "%s %s %lu\n", line, type, buffer_bytes);
+		fwrite(buffer, 1, buffer_bytes, stdout);
+		fputc('\n', stdout);
+	}
+	free(line);
+	object_reader_release(&reader);
+
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IONBF, 0);
+	free(output);
+
+	return ferror(stdout) ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
+	static uint8_t chunk[OBJECT_CHUNK_BYTES];
+	struct object_stream stream;
 	char *error;
-	int i;
-	uint64_t buffer_bytes;
-	uint8_t *buffer;
+	ssize_t bytes;
 	uint8_t sha1[20];
 
-	if (argc < 2 || hex2sha1(argv[1], sha1) < 0)
+	if (argc < 2)
 		return usage(argv[0], 1, NULL);
 
-	buffer = file_sha1_read(sha1, &buffer_bytes, &error);
-	if (!buffer) {
-		fprintf(stderr, "%s", error);
-		free(error);
-		return 1;
+	if (!strncmp(argv[1], "--help", sizeof("--help")) ||
+			!strncmp(argv[1], "-h", sizeof("-h")))
+		return usage(argv[0], 0, NULL);
+	if (!strncmp(argv[1], "--batch", sizeof("--batch")))
+		return batch(0);
+	if (!strncmp(argv[1], "--batch-check", sizeof("--batch-check")))
+		return batch(1);
+
+	/* type or size only */
+	if (!strncmp(argv[1], "-t", sizeof("-t")) ||
+			!strncmp(argv[1], "-s", sizeof("-s"))) {
+		char type[OBJECT_TYPE_BYTES];
+		uint64_t size;
+
+		if (argc < 3 || hex2sha1(argv[2], sha1) < 0)
+			return usage(argv[0], 1, NULL);
+		if (object_info(sha1, type, &size, &error) < 0)
+			goto fail;
+		if (argv[1][1] == 't')
+			fprintf(stdout, "%s\n", type);
+		else
+			fprintf(stdout, "%lu\n", size);
+		return 0;
 	}
 
-	for (i = 0; i < buffer_bytes; i++)
-		fprintf(stdout, "%c", buffer[i]);
-	free(buffer);
+	if (hex2sha1(argv[1], sha1) < 0)
+		return usage(argv[0], 1, NULL);
+
+	if (object_stream_open(&stream, sha1, &error) < 0)
+		goto fail;
+
+	while ((bytes = object_stream_read(&stream, chunk, sizeof(chunk),
+					&error)) > 0) {
+		if (exact_write(STDOUT_FILENO, chunk, bytes, &error) < 0)
+			break;
+	}
+	object_stream_close(&stream);
+	if (bytes != 0)
+		goto fail;
 
 	return 0;
+
+fail:
+	fprintf(stderr, "%s\n", error);
+	free(error);
+	return 1;
 }
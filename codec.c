@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "codec.h"
+#include "config.h"
+
+static int zlib_compress_init(struct codec_stream *stream, int level)
+{
+	return deflateInit(&stream->z, level) == Z_OK ? 0 : -1;
+}
+
+static int zlib_compress(struct codec_stream *stream, int finish)
+{
+	int result;
+
+	result = deflate(&stream->z, finish ? Z_FINISH : Z_NO_FLUSH);
+	if (result == Z_STREAM_END)
+		return CODEC_END;
+	if (result == Z_OK || result == Z_BUF_ERROR)
+		return CODEC_OK;
+	return -1;
+}
+
+static void zlib_compress_end(struct codec_stream *stream)
+{
+	deflateEnd(&stream->z);
+}
+
+static int zlib_decompress_init(struct codec_stream *stream)
+{
+	return inflateInit(&stream->z) == Z_OK ? 0 : -1;
+}
+
+static int zlib_decompress(struct codec_stream *stream)
+{
+	int result;
+
+	result = inflate(&stream->z, Z_NO_FLUSH);
+	if (result == Z_STREAM_END)
+		return CODEC_END;
+	if (result == Z_OK || result == Z_BUF_ERROR)
+		return CODEC_OK;
+	return -1;
+}
+
+static int zlib_decompress_reset(struct codec_stream *stream)
+{
+	return inflateReset(&stream->z) == Z_OK ? 0 : -1;
+}
+
+static void zlib_decompress_end(struct codec_stream *stream)
+{
+	inflateEnd(&stream->z);
+}
+
+const struct codec codec_zlib = {
+	.name = "zlib",
+	.compress_init = zlib_compress_init,
+	.compress = zlib_compress,
+	.compress_end = zlib_compress_end,
+	.decompress_init = zlib_decompress_init,
+	.decompress = zlib_decompress,
+	.decompress_reset = zlib_decompress_reset,
+	.decompress_end = zlib_decompress_end,
+};
+
+/* "stored" objects are the tag followed by the raw object */
+static void stored_copy(struct codec_stream *stream)
+{
+	size_t bytes;
+
+	bytes = stream->z.avail_in;
+	if (bytes > stream->z.avail_out)
+		bytes = stream->z.avail_out;
+
+	memcpy(stream->z.next_out, stream->z.next_in, bytes);
+	stream->z.next_in += bytes;
+	stream->z.avail_in -= bytes;
+	stream->z.total_in += bytes;
+	stream->z.next_out += bytes;
+	stream->z.avail_out -= bytes;
+	stream->z.total_out += bytes;
+}
+
+static int stored_compress_init(struct codec_stream *stream, int level)
+{
+	stream->tag_bytes = 1;
+	return 0;
+}
+
+static int stored_compress(struct codec_stream *stream, int finish)
+{
+	if (stream->tag_bytes) {
+		if (stream->z.avail_out == 0)
+			return CODEC_OK;
+		*stream->z.next_out++ = CODEC_TAG_STORED;
+		stream->z.avail_out--;
+		stream->tag_bytes = 0;
+	}
+
+	stored_copy(stream);
+	if (finish && stream->z.avail_in == 0)
+		return CODEC_END;
+	return CODEC_OK;
+}
+
+static void stored_end(struct codec_stream *stream)
+{
+}
+
+static int stored_decompress_init(struct codec_stream *stream)
+{
+	stream->tag_bytes = 1;
+	return 0;
+}
+
+static int stored_decompress(struct codec_stream *stream)
+{
+	if (stream->tag_bytes) {
+		if (stream->z.avail_in == 0)
+			return CODEC_OK;
+		stream->z.next_in++;
+		stream->z.avail_in--;
+		stream->tag_bytes = 0;
+	}
+
+	/* there is no end marker, the stream ends with the input */
+	stored_copy(stream);
+	if (stream->z.avail_in == 0)
+		return CODEC_END;
+	return CODEC_OK;
+}
+
+const struct codec codec_stored = {
+	.name = "stored",
+	.compress_init = stored_compress_init,
+	.compress = stored_compress,
+	.compress_end = stored_end,
+	.decompress_init = stored_decompress_init,
+	.decompress = stored_decompress,
+	.decompress_reset = stored_decompress_init,
+	.decompress_end = stored_end,
+};
+
+static const struct codec *codecs[] = {
+	&codec_zlib,
+	&codec_stored,
+};
+
+const struct codec *codec_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		if (!strcmp(codecs[i]->name, name))
+			return codecs[i];
+	}
+
+	return NULL;
+}
+
+const struct codec *codec_detect(const uint8_t *data, size_t bytes)
+{
+	if (bytes == 0)
+		return NULL;
+	if (data[0] == CODEC_TAG_STORED)
+		return &codec_stored;
+	/* CMF/FLG: deflate method, header checksum multiple of 31 */
+	if (bytes >= 2 && (data[0] & 0x0f) == Z_DEFLATED &&
+			((data[0] << 8) | data[1]) % 31 == 0)
+		return &codec_zlib;
+
+	return NULL;
+}
+
+const struct codec *codec_default(int *level, int default_level)
+{
+	const char *name;
+	const struct codec *codec;
+
+	*level = config_get_int("core.compression", "GT_COMPRESSION",
+			default_level);
+	if (*level < Z_DEFAULT_COMPRESSION || *level > Z_BEST_COMPRESSION) {
+		fprintf(stderr, "warning: invalid compression level %d\n", *level);
+		*level = default_level;
+	}
+
+	name = config_get("core.codec", "GT_CODEC");
+	if (!name)
+		return &codec_zlib;
+
+	codec = codec_find(name);
+	if (!codec) {
+		fprintf(stderr, "warning: unknown codec '%s', using zlib\n", name);
+		return &codec_zlib;
+	}
+
+	return codec;
+}
+
+int codec_compress_init(struct codec_stream *stream,
+		const struct codec *codec, int level)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->codec = codec;
+
+	return codec->compress_init(stream, level);
+}
+
+int codec_compress(struct codec_stream *stream, int finish)
+{
+	return stream->codec->compress(stream, finish);
+}
+
+void codec_compress_end(struct codec_stream *stream)
+{
+	stream->codec->compress_end(stream);
+}
+
+int codec_decompress_init(struct codec_stream *stream,
+		const uint8_t *data, size_t bytes)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->z.next_in = (uint8_t *) data;
+	stream->z.avail_in = bytes;
+	stream->codec = codec_detect(data, bytes);
+	if (!stream->codec)
+		return -1;
+
+	return stream->codec->decompress_init(stream);
+}
+
+int codec_decompress_reset(struct codec_stream *stream,
+		const uint8_t *data, size_t bytes)
+{
+	const struct codec *codec;
+
+	codec = codec_detect(data, bytes);
+	if (!stream->codec || stream->codec != codec) {
+		if (stream->codec)
+			codec_decompress_end(stream);
+		if (codec_decompress_init(stream, data, bytes) < 0) {
+			stream->codec = NULL;
+			return -1;
+		}
+		return 0;
+	}
+
+	stream->z.next_in = (uint8_t *) data;
+	stream->z.avail_in = bytes;
+	stream->z.total_in = stream->z.total_out = 0;
+
+	return stream->codec->decompress_reset(stream);
+}
+
+ssize_t codec_peek(const uint8_t *data, size_t data_bytes,
+		uint8_t *buffer, size_t bytes)
+{
+	struct codec_stream stream;
+	int result;
+
+	if (codec_decompress_init(&stream, data, data_bytes) < 0)
+		return -1;
+	stream.z.next_out = buffer;
+	stream.z.avail_out = bytes;
+	do {
+		uInt avail_out = stream.z.avail_out;
+
+		result = codec_decompress(&stream);
+		if (avail_out == stream.z.avail_out)
+			break;
+	} while (result == CODEC_OK && stream.z.avail_out > 0);
+	codec_decompress_end(&stream);
+
+	if (result < 0)
+		return -1;
+	return bytes - stream.z.avail_out;
+}
+
+int codec_decompress(struct codec_stream *stream)
+{
+	return stream->codec->decompress(stream);
+}
+
+void codec_decompress_end(struct codec_stream *stream)
+{
+	stream->codec->decompress_end(stream);
+}
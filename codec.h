@@ -0,0 +1,75 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+/* Loose objects go through a codec before reaching the disk. The first bytes
+ * of an object file tell which codec wrote it: zlib streams identify
+ * themselves with their own 2 bytes header (which never starts with a NUL),
+ * other codecs prefix the stream with a one byte tag. */
+
+#define CODEC_TAG_STORED	0x00
+
+struct codec_stream;
+
+struct codec {
+	const char *name;
+	int (*compress_init)(struct codec_stream *stream, int level);
+	int (*compress)(struct codec_stream *stream, int finish);
+	void (*compress_end)(struct codec_stream *stream);
+	int (*decompress_init)(struct codec_stream *stream);
+	int (*decompress)(struct codec_stream *stream);
+	int (*decompress_reset)(struct codec_stream *stream);
+	void (*decompress_end)(struct codec_stream *stream);
+};
+
+/* Input and output buffers are described with the zlib fields (next_in,
+ * avail_in, next_out, avail_out, total_out) whatever the codec. */
+struct codec_stream {
+	const struct codec *codec;
+	z_stream z;
+	int tag_bytes;
+};
+
+extern const struct codec codec_zlib;
+extern const struct codec codec_stored;
+
+const struct codec *codec_find(const char *name);
+const struct codec *codec_detect(const uint8_t *data, size_t bytes);
+
+/* codec and level configured for the repository (core.codec/GT_CODEC and
+ * core.compression/GT_COMPRESSION) */
+const struct codec *codec_default(int *level, int default_level);
+
+/* The compress and decompress calls return CODEC_END once the whole stream
+ * has been produced, CODEC_OK when they need more room or more input and -1
+ * on error. */
+#define CODEC_OK	0
+#define CODEC_END	1
+
+int codec_compress_init(struct codec_stream *stream,
+		const struct codec *codec, int level);
+int codec_compress(struct codec_stream *stream, int finish);
+void codec_compress_end(struct codec_stream *stream);
+
+/* the codec is detected from the first bytes of data */
+int codec_decompress_init(struct codec_stream *stream,
+		const uint8_t *data, size_t bytes);
+/* start decompressing a new stream, keeping the state allocated by the
+ * previous one when the codec is the same. The stream must have been
+ * initialized (or zeroed) before. */
+int codec_decompress_reset(struct codec_stream *stream,
+		const uint8_t *data, size_t bytes);
+int codec_decompress(struct codec_stream *stream);
+void codec_decompress_end(struct codec_stream *stream);
+
+/* Decompress no more than the first bytes of a stream, returns how many were
+ * produced (fewer when the stream is shorter) or -1 */
+ssize_t codec_peek(const uint8_t *data, size_t data_bytes,
+		uint8_t *buffer, size_t bytes);
+
+#endif /* CODEC_H */
@@ -57,6 +57,7 @@ int file_read(const char *filename,
 		char **error)
 {
 	int fd;
+	int result;
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
@@ -64,5 +65,8 @@ int file_read(const char *filename,
 		return -1;
 	}
 
-	return fd_read(fd, buffer, bytes, error);
+	result = fd_read(fd, buffer, bytes, error);
+	close(fd);
+
+	return result;
 }
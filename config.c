@@ -0,0 +1,188 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "index.h"
+
+struct config_entry {
+	char *key;
+	char *value;
+};
+
+/* the configuration is read once per process, whichever thread comes first */
+static struct config_entry *entries;
+static size_t entries_count;
+static pthread_once_t loaded = PTHREAD_ONCE_INIT;
+
+static void config_path(char *path, size_t bytes)
+{
+	char *directory;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(path, bytes, "%s/config", directory);
+}
+
+static char *strip(char *s)
+{
+	char *end;
+
+	while (isspace(*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace(end[-1]))
+		end--;
+	*end = '\0';
+
+	return s;
+}
+
+static int config_entry_set(const char *key, const char *value)
+{
+	int i;
+	void *ptr;
+
+	for (i = 0; i < entries_count; i++) {
+		if (!strcmp(entries[i].key, key)) {
+			free(entries[i].value);
+			entries[i].value = strdup(value);
+			return 0;
+		}
+	}
+
+	ptr = realloc(entries, (entries_count + 1) * sizeof(*entries));
+	if (!ptr)
+		return -1;
+	entries = ptr;
+	entries[entries_count].key = strdup(key);
+	entries[entries_count].value = strdup(value);
+	entries_count++;
+
+	return 0;
+}
+
+static void config_read(void)
+{
+	char path[PATH_MAX];
+	uint8_t *buffer;
+	size_t bytes;
+	char *error;
+	char *line, *next;
+
+	config_path(path, sizeof(path));
+	if (access(path, F_OK) < 0)
+		return;
+	if (file_read(path, &buffer, &bytes, &error) < 0) {
+		fprintf(stderr, "warning: ignoring configuration: %s\n", error);
+		free(error);
+		return;
+	}
+
+	for (line = (char *) buffer; line < (char *) buffer + bytes; line = next) {
+		char *equal;
+
+		next = memchr(line, '\n', (char *) buffer + bytes - line);
+		if (next)
+			*next++ = '\0';
+		else
+			next = (char *) buffer + bytes;
+
+		line = strip(line);
+		if (*line == '\0' || *line == '#')
+			continue;
+		equal = strchr(line, '=');
+		if (!equal)
+			continue;
+		*equal = '\0';
+		config_entry_set(strip(line), strip(equal + 1));
+	}
+
+	free(buffer);
+}
+
+static void config_load(void)
+{
+	pthread_once(&loaded, config_read);
+}
+
+const char *config_get(const char *key, const char *env)
+{
+	const char *value;
+	int i;
+
+	if (env && (value = getenv(env)))
+		return value;
+
+	config_load();
+	for (i = 0; i < entries_count; i++) {
+		if (!strcmp(entries[i].key, key))
+			return entries[i].value;
+	}
+
+	return NULL;
+}
+
+int config_get_int(const char *key, const char *env, int default_value)
+{
+	const char *value;
+	char *end;
+	long result;
+
+	value = config_get(key, env);
+	if (!value)
+		return default_value;
+
+	result = strtol(value, &end, 0);
+	if (end == value || *end != '\0') {
+		fprintf(stderr, "warning: invalid integer '%s' for %s\n", value, key);
+		return default_value;
+	}
+
+	return result;
+}
+
+/* Rewrite the whole configuration file with 'key' set to 'value' */
+int config_set(const char *key, const char *value, char **error)
+{
+	char path[PATH_MAX];
+	char lock[PATH_MAX + sizeof(".lock")];
+	FILE *f;
+	int i;
+
+	config_load();
+	if (config_entry_set(key, value) < 0) {
+		asprintf(error, "realloc fail: %m");
+		return -1;
+	}
+
+	config_path(path, sizeof(path));
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	f = fopen(lock, "w");
+	if (!f) {
+		asprintf(error, "open '%s' fail: %m", lock);
+		return -1;
+	}
+	for (i = 0; i < entries_count; i++)
+		fprintf(f, "%s = %s\n", entries[i].key, entries[i].value);
+	if (fclose(f) != 0) {
+		asprintf(error, "write '%s' fail: %m", lock);
+		unlink(lock);
+		return -1;
+	}
+
+	if (rename(lock, path) < 0) {
+		asprintf(error, "rename '%s' fail: %m", path);
+		unlink(lock);
+		return -1;
+	}
+
+	return 0;
+}
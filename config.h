@@ -0,0 +1,13 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* Repository configuration, read from $GT_DIRECTORY/config. The file is made
+ * of "key = value" lines, lines starting with '#' are comments. When 'env' is
+ * not NULL and names a set environment variable, its value takes precedence
+ * over the file. */
+const char *config_get(const char *key, const char *env);
+int config_get_int(const char *key, const char *env, int default_value);
+
+int config_set(const char *key, const char *value, char **error);
+
+#endif /* CONFIG_H */
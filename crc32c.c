@@ -0,0 +1,92 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL	0x82F63B78	/* reversed */
+
+/* slicing by 8: table[k][b] is the crc of byte b followed by k zeros */
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = table[0][crc & 0xff] ^ (crc >> 8);
+			table[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_tables(uint32_t crc, const uint8_t *data, size_t bytes)
+{
+	pthread_once(&table_once, table_init);
+
+	while (bytes >= 8) {
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		word ^= crc;
+		crc = table[7][word & 0xff] ^
+			table[6][(word >> 8) & 0xff] ^
+			table[5][(word >> 16) & 0xff] ^
+			table[4][(word >> 24) & 0xff] ^
+			table[3][(word >> 32) & 0xff] ^
+			table[2][(word >> 40) & 0xff] ^
+			table[1][(word >> 48) & 0xff] ^
+			table[0][word >> 56];
+		data += 8;
+		bytes -= 8;
+	}
+	while (bytes--)
+		crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t bytes)
+{
+	uint64_t crc64 = crc;
+
+	while (bytes >= 8) {
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		bytes -= 8;
+	}
+	crc = crc64;
+	while (bytes--)
+		crc = _mm_crc32_u8(crc, *data++);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t bytes)
+{
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_sse42(crc, data, bytes);
+#endif
+	return ~crc32c_tables(crc, data, bytes);
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* CRC-32C (Castagnoli), with the SSE 4.2 crc32 instruction when the cpu has
+ * it, tables otherwise. Start with crc = 0. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t bytes);
+
+#endif /* CRC32C_H */
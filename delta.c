@@ -0,0 +1,321 @@
+#include <string.h>
+
+#include "delta.h"
+
+/* Blocks of the base are indexed every DELTA_BLOCK bytes, a match must cover
+ * at least one block to be used */
+#define DELTA_BLOCK		16
+#define DELTA_COPY_MAX	0xffffff
+#define DELTA_INSERT_MAX	127
+/* bound the work on repetitive data where buckets get long */
+#define DELTA_CANDIDATES_MAX	64
+
+struct delta_index {
+	uint32_t *buckets;	/* first block of each hash bucket, plus one */
+	uint32_t *next;		/* next block in the same bucket, plus one */
+	uint32_t mask;
+};
+
+struct delta_output {
+	uint8_t *data;
+	size_t bytes;
+	size_t max_bytes;
+};
+
+size_t varint_encode(uint8_t *buffer, uint64_t value)
+{
+	size_t bytes = 0;
+
+	do {
+		buffer[bytes] = value & 0x7f;
+		value >>= 7;
+		if (value)
+			buffer[bytes] |= 0x80;
+		bytes++;
+	} while (value);
+
+	return bytes;
+}
+
+int varint_decode(const uint8_t *buffer, size_t bytes, uint64_t *value)
+{
+	int shift;
+	size_t i;
+
+	*value = 0;
+	for (i = 0, shift = 0; i < bytes && shift < 64; i++, shift += 7) {
+		*value |= (uint64_t) (buffer[i] & 0x7f) << shift;
+		if (!(buffer[i] & 0x80))
+			return i + 1;
+	}
+
+	return -1;
+}
+
+static uint32_t block_hash(const uint8_t *data)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < DELTA_BLOCK; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+
+	return hash;
+}
+
+static int delta_index_init(struct delta_index *index,
+		const uint8_t *base, size_t base_bytes)
+{
+	size_t blocks, i;
+	uint32_t size;
+
+	blocks = base_bytes / DELTA_BLOCK;
+	for (size = 16; size < blocks; size <<= 1);
+	index->mask = size - 1;
+	index->buckets = calloc(size, sizeof(uint32_t));
+	index->next = malloc((blocks + 1) * sizeof(uint32_t));
+	if (!index->buckets || !index->next) {
+		free(index->buckets);
+		free(index->next);
+		return -1;
+	}
+
+	/* walk backwards so that buckets list the earliest blocks first */
+	for (i = blocks; i > 0; i--) {
+		uint32_t hash = block_hash(base + (i - 1) * DELTA_BLOCK) & index->mask;
+
+		index->next[i - 1] = index->buckets[hash];
+		index->buckets[hash] = i;
+	}
+
+	return 0;
+}
+
+static void delta_index_uninit(struct delta_index *index)
+{
+	free(index->buckets);
+	free(index->next);
+}
+
+static int delta_emit(struct delta_output *output, const void *data, size_t bytes)
+{
+	if (output->bytes + bytes >= output->max_bytes)
+		return -1;
+	memcpy(output->data + output->bytes, data, bytes);
+	output->bytes += bytes;
+
+	return 0;
+}
+
+static int delta_insert(struct delta_output *output,
+		const uint8_t *data, size_t bytes)
+{
+	while (bytes > 0) {
+		uint8_t n = bytes > DELTA_INSERT_MAX ? DELTA_INSERT_MAX : bytes;
+
+		if (delta_emit(output, &n, 1) < 0 ||
+				delta_emit(output, data, n) < 0)
+			return -1;
+		data += n;
+		bytes -= n;
+	}
+
+	return 0;
+}
+
+static int delta_copy(struct delta_output *output, size_t offset, size_t bytes)
+{
+	while (bytes > 0) {
+		uint8_t instruction[8];
+		size_t n, length;
+		int i;
+
+		n = bytes > DELTA_COPY_MAX ? DELTA_COPY_MAX : bytes;
+		instruction[0] = 0x80;
+		length = 1;
+		for (i = 0; i < 4; i++) {
+			uint8_t byte = (offset >> (i * 8)) & 0xff;
+
+			if (byte) {
+				instruction[0] |= 1 << i;
+				instruction[length++] = byte;
+			}
+		}
+		for (i = 0; i < 3; i++) {
+			uint8_t byte = (n >> (i * 8)) & 0xff;
+
+			if (byte) {
+				instruction[0] |= 0x10 << i;
+				instruction[length++] = byte;
+			}
+		}
+		if (delta_emit(output, instruction, length) < 0)
+			return -1;
+		offset += n;
+		bytes -= n;
+	}
+
+	return 0;
+}
+
+uint8_t *delta_create(const uint8_t *base, size_t base_bytes,
+		const uint8_t *target, size_t target_bytes,
+		size_t max_bytes, size_t *delta_bytes)
+{
+	struct delta_index index;
+	struct delta_output output;
+	uint8_t header[20];
+	size_t insert, position;
+
+	/* offsets are encoded on 32 bits */
+	if (base_bytes < DELTA_BLOCK || base_bytes > UINT32_MAX ||
+			max_bytes < sizeof(header))
+		return NULL;
+
+	output.data = malloc(max_bytes);
+	if (!output.data)
+		return NULL;
+	output.bytes = 0;
+	output.max_bytes = max_bytes;
+
+	if (delta_index_init(&index, base, base_bytes) < 0) {
+		free(output.data);
+		return NULL;
+	}
+
+	output.bytes = varint_encode(header, base_bytes);
+	output.bytes += varint_encode(header + output.bytes, target_bytes);
+	memcpy(output.data, header, output.bytes);
+
+	insert = position = 0;
+	while (position + DELTA_BLOCK <= target_bytes) {
+		uint32_t hash, block;
+		size_t best_offset, best_bytes, best_back;
+		int candidates;
+
+		hash = block_hash(target + position) & index.mask;
+		best_bytes = best_offset = best_back = 0;
+		candidates = 0;
+		for (block = index.buckets[hash];
+				block && candidates < DELTA_CANDIDATES_MAX;
+				block = index.next[block - 1], candidates++) {
+			size_t offset = (block - 1) * DELTA_BLOCK;
+			size_t bytes = 0, back = 0;
+
+			while (offset + bytes < base_bytes &&
+					position + bytes < target_bytes &&
+					base[offset + bytes] == target[position + bytes])
+				bytes++;
+			if (bytes < DELTA_BLOCK)
+				continue;
+			/* the match may start before, in bytes still to insert */
+			while (back < position - insert && back < offset &&
+					base[offset - back - 1] == target[position - back - 1])
+				back++;
+			if (bytes + back > best_bytes + best_back) {
+				best_offset = offset;
+				best_bytes = bytes;
+				best_back = back;
+			}
+		}
+
+		if (!best_bytes) {
+			position++;
+			continue;
+		}
+
+		if (delta_insert(&output, target + insert,
+					position - best_back - insert) < 0 ||
+				delta_copy(&output, best_offset - best_back,
+					best_bytes + best_back) < 0)
+			goto fail;
+		position += best_bytes;
+		insert = position;
+	}
+
+	if (delta_insert(&output, target + insert, target_bytes - insert) < 0)
+		goto fail;
+
+	delta_index_uninit(&index);
+	*delta_bytes = output.bytes;
+
+	return output.data;
+
+fail:
+	delta_index_uninit(&index);
+	free(output.data);
+	return NULL;
+}
+
+uint8_t *delta_apply(const uint8_t *base, size_t base_bytes,
+		const uint8_t *delta, size_t delta_bytes,
+		size_t *target_bytes)
+{
+	const uint8_t *end;
+	uint64_t size;
+	uint8_t *target, *out;
+	int n;
+
+	end = delta + delta_bytes;
+	n = varint_decode(delta, delta_bytes, &size);
+	if (n < 0 || size != base_bytes)
+		return NULL;
+	delta += n;
+	n = varint_decode(delta, end - delta, &size);
+	if (n < 0)
+		return NULL;
+	delta += n;
+
+	target = malloc(size ? size : 1);
+	if (!target)
+		return NULL;
+	out = target;
+
+	while (delta < end) {
+		uint8_t instruction = *delta++;
+
+		if (instruction & 0x80) {
+			size_t offset = 0, bytes = 0;
+			int i;
+
+			for (i = 0; i < 4; i++) {
+				if (!(instruction & (1 << i)))
+					continue;
+				if (delta == end)
+					goto fail;
+				offset |= (size_t) *delta++ << (i * 8);
+			}
+			for (i = 0; i < 3; i++) {
+				if (!(instruction & (0x10 << i)))
+					continue;
+				if (delta == end)
+					goto fail;
+				bytes |= (size_t) *delta++ << (i * 8);
+			}
+			if (offset + bytes > base_bytes ||
+					bytes > target + size - out)
+				goto fail;
+			memcpy(out, base + offset, bytes);
+			out += bytes;
+		} else if (instruction) {
+			if (instruction > end - delta ||
+					instruction > target + size - out)
+				goto fail;
+			memcpy(out, delta, instruction);
+			out += instruction;
+			delta += instruction;
+		} else {
+			goto fail;
+		}
+	}
+
+	if (out != target + size)
+		goto fail;
+	*target_bytes = size;
+
+	return target;
+
+fail:
+	free(target);
+	return NULL;
+}
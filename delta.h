@@ -0,0 +1,28 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+/* A delta rebuilds a target buffer from a base buffer. It starts with the
+ * base and target sizes (varints) followed by instructions:
+ *
+ *   1xxxxxxx  copy from the base. The low 4 bits tell which of the 4 offset
+ *             bytes follow, the next 3 bits which of the 3 size bytes follow
+ *             (little endian, missing bytes are zero)
+ *   0nnnnnnn  insert the n (1 to 127) bytes that follow
+ */
+
+/* Returns NULL when the delta would not be smaller than max_bytes */
+uint8_t *delta_create(const uint8_t *base, size_t base_bytes,
+		const uint8_t *target, size_t target_bytes,
+		size_t max_bytes, size_t *delta_bytes);
+
+uint8_t *delta_apply(const uint8_t *base, size_t base_bytes,
+		const uint8_t *delta, size_t delta_bytes,
+		size_t *target_bytes);
+
+size_t varint_encode(uint8_t *buffer, uint64_t value);
+int varint_decode(const uint8_t *buffer, size_t bytes, uint64_t *value);
+
+#endif /* DELTA_H */
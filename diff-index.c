@@ -0,0 +1,232 @@
+#include <linux/limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cache.h"
+#include "index.h"
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
+{
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h] [--name-only|--name-status] <tree>\n", program);
+
+	return return_value;
+}
+
+/* Compare the tree of the directory at diff->path, NULL standing for an
+ * empty tree, with the index entries from *position on, under cache.
+ *
+ * The tree and the index are walked together, entries in order. The index
+ * entries of a directory whose tree cache node has the sha1 of the tree are
+ * skipped at once, without reading the tree, and so are the files with the
+ * same sha1 on both sides: the cost depends on the size of the changes, not
+ * of the index. */
+static int index_diff_walk(struct tree_diff *diff, struct index *index,
+		uint32_t *position, size_t prefix_bytes, uint8_t *sha1,
+		struct tree_cache *cache)
+{
+	const struct cached_object *tree = NULL;
+	const uint8_t *data = NULL, *end = NULL;
+	struct tree_entry entry_a;
+	int next_a;
+	char *error;
+	int result = -1;
+
+	/* the index has the same tree for the directory */
+	if (sha1 && cache && cache->entries_count >= 0 &&
+			!memcmp(cache->sha1, sha1, 20)) {
+		*position += cache->entries_count;
+		return 0;
+	}
+	if (sha1) {
+		tree = tree_object_get(sha1, &error);
+		if (!tree) {
+			fprintf(stderr, "%s\n", error);
+			free(error);
+			return -1;
+		}
+		data = tree->data;
+		end = tree->data + tree->bytes;
+	}
+
+	next_a = tree_entry_next(&data, end, &entry_a);
+	for (;;) {
+		struct index_entry *entry = NULL;
+		struct tree_cache *subtree;
+		struct tree_entry entry_b;
+		const char *slash = NULL;
+		int tree_a, tree_b;
+		size_t path_bytes;
+		int compare;
+
+		if (next_a < 0) {
+			fprintf(stderr, "corrupt tree '%s'\n", sha12hex(sha1));
+			goto done;
+		}
+		/* the next index entry, when in the directory */
+		if (*position < index->entries_count) {
+			entry = index->entries[*position];
+			if (entry->name_bytes <= prefix_bytes ||
+					memcmp(entry->name, diff->path, prefix_bytes))
+				entry = NULL;
+		}
+		if (next_a && !entry)
+			break;
+		if (entry) {
+			entry_b.mode = entry->st_mode;
+			entry_b.name = entry->name + prefix_bytes;
+			entry_b.name_bytes = entry->name_bytes - prefix_bytes;
+			entry_b.sha1 = entry->sha1;
+			/* or the subdirectory it is in */
+			slash = memchr(entry_b.name, '/', entry_b.name_bytes);
+			if (slash) {
+				entry_b.mode = TREE_MODE;
+				entry_b.name_bytes = slash - entry_b.name;
+			}
+		}
+		tree_a = next_a == 0 && entry_a.mode == TREE_MODE;
+		tree_b = slash != NULL;
+		if (next_a == 0 && entry)
+			compare = tree_entry_compare(entry_a.name, entry_a.name_bytes,
+					tree_a, entry_b.name, entry_b.name_bytes, tree_b);
+		else
+			compare = next_a == 0 ? -1 : 1;
+
+		subtree = NULL;
+		if (tree_b && cache)
+			subtree = tree_cache_subtree(cache, entry_b.name,
+					entry_b.name_bytes, 0);
+		if (compare == 0 && !tree_a && entry_a.mode == entry_b.mode &&
+				!memcmp(entry_a.sha1, entry_b.sha1, 20)) {
+			(*position)++;
+			goto next;
+		}
+
+		path_bytes = tree_diff_path_append(diff, prefix_bytes,
+				compare <= 0 ? &entry_a : &entry_b);
+		if (!path_bytes)
+			goto done;
+		if (compare == 0 && tree_a) {
+			diff->path[path_bytes++] = '/';
+			if (index_diff_walk(diff, index, position, path_bytes,
+						(uint8_t *) entry_a.sha1, subtree) < 0)
+				goto done;
+		} else if (compare == 0) {
+			if (tree_diff_change(diff, path_bytes, entry_a.mode, entry_a.sha1,
+						entry_b.mode, entry_b.sha1) < 0)
+				goto done;
+			(*position)++;
+		} else if (compare < 0 && tree_a) {
+			/* no index entry is in that directory */
+			diff->path[path_bytes++] = '/';
+			if (index_diff_walk(diff, index, position, path_bytes,
+						(uint8_t *) entry_a.sha1, NULL) < 0)
+				goto done;
+		} else if (compare < 0) {
+			if (tree_diff_change(diff, path_bytes, entry_a.mode, entry_a.sha1,
+						0, null_sha1) < 0)
+				goto done;
+		} else if (tree_b) {
+			diff->path[path_bytes++] = '/';
+			if (index_diff_walk(diff, index, position, path_bytes, NULL,
+						NULL) < 0)
+				goto done;
+		} else {
+			if (tree_diff_change(diff, path_bytes, 0, null_sha1,
+						entry_b.mode, entry_b.sha1) < 0)
+				goto done;
+			(*position)++;
+		}
+
+next:
+		if (compare <= 0)
+			next_a = tree_entry_next(&data, end, &entry_a);
+	}
+	result = 0;
+
+done:
+	if (tree)
+		object_cache_put(tree);
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct cached_object *tree;
+	struct tree_diff diff;
+	struct index *index;
+	const char *name;
+	uint8_t sha1[20];
+	uint32_t position;
+	char *error;
+	int i;
+
+	memset(&diff, 0, sizeof(diff));
+	diff.output = TREE_DIFF_RAW;
+	name = NULL;
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		if (!strncmp(arg, "--name-only", sizeof("--name-only"))) {
+			diff.output = TREE_DIFF_NAME_ONLY;
+			continue;
+		}
+		if (!strncmp(arg, "--name-status", sizeof("--name-status"))) {
+			diff.output = TREE_DIFF_NAME_STATUS;
+			continue;
+		}
+		if (arg[0] == '-')
+			return usage(argv[0], 1, "Unknown option '%s'", arg);
+		if (name)
+			return usage(argv[0], 1, "too many trees");
+		name = arg;
+	}
+	if (!name)
+		return usage(argv[0], 1, "a tree is needed");
+	if (hex2sha1(name, sha1) < 0)
+		return usage(argv[0], 1, "invalid sha1 '%s'", name);
+
+	/* from a commit to its tree, to compare it with the tree cache */
+	tree = tree_object_get(sha1, &error);
+	if (!tree) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
+	memcpy(sha1, tree->sha1, sizeof(sha1));
+	object_cache_put(tree);
+
+	index = index_open_readonly(&error);
+	if (!index) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
+
+	if (buffer_init(&diff.out) < 0)
+		return 1;
+	position = 0;
+	if (index_diff_walk(&diff, index, &position, 0, sha1, index->tree) < 0)
+		return 1;
+	if (buffer_flush(&diff.out, 0) < 0)
+		return 1;
+	buffer_uninit(&diff.out);
+	index_free(index);
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+#include <linux/limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cache.h"
+#include "index.h"
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
+{
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h] [--name-only|--name-status] <tree-a> <tree-b>\n", program);
+
+	return return_value;
+}
+
+/* Compare the trees a and b of the directory at diff->path, NULL standing
+ * for an empty tree.
+ *
+ * The trees are walked together, entries in order: subtrees and files with
+ * the same sha1 on both sides are skipped without being read, so that the
+ * cost depends on the size of the changes, not of the trees. */
+static int tree_diff_walk(struct tree_diff *diff, size_t prefix_bytes,
+		uint8_t *sha1_a, uint8_t *sha1_b)
+{
+	const struct cached_object *a = NULL, *b = NULL;
+	const uint8_t *data_a = NULL, *end_a = NULL;
+	const uint8_t *data_b = NULL, *end_b = NULL;
+	struct tree_entry entry_a, entry_b;
+	int next_a, next_b;
+	char *error;
+	int result = -1;
+
+	if (sha1_a && sha1_b && !memcmp(sha1_a, sha1_b, 20))
+		return 0;
+	if (sha1_a) {
+		a = tree_object_get(sha1_a, &error);
+		if (!a)
+			goto fail_error;
+		data_a = a->data;
+		end_a = a->data + a->bytes;
+	}
+	if (sha1_b) {
+		b = tree_object_get(sha1_b, &error);
+		if (!b)
+			goto fail_error;
+		data_b = b->data;
+		end_b = b->data + b->bytes;
+	}
+
+	next_a = tree_entry_next(&data_a, end_a, &entry_a);
+	next_b = tree_entry_next(&data_b, end_b, &entry_b);
+	while (next_a == 0 || next_b == 0) {
+		int tree_a, tree_b;
+		size_t path_bytes;
+		int compare;
+
+		if (next_a < 0 || next_b < 0) {
+			fprintf(stderr, "corrupt tree '%s'\n",
+					sha12hex(next_a < 0 ? sha1_a : sha1_b));
+			goto done;
+		}
+		tree_a = next_a == 0 && entry_a.mode == TREE_MODE;
+		tree_b = next_b == 0 && entry_b.mode == TREE_MODE;
+		if (next_a == 0 && next_b == 0)
+			compare = tree_entry_compare(entry_a.name, entry_a.name_bytes,
+					tree_a, entry_b.name, entry_b.name_bytes, tree_b);
+		else
+			compare = next_a == 0 ? -1 : 1;
+
+		/* same name and type, the same sha1 means the same content */
+		if (compare == 0 && entry_a.mode == entry_b.mode &&
+				!memcmp(entry_a.sha1, entry_b.sha1, 20))
+			goto next;
+
+		path_bytes = tree_diff_path_append(diff, prefix_bytes,
+				compare <= 0 ? &entry_a : &entry_b);
+		if (!path_bytes)
+			goto done;
+		if (compare == 0 && tree_a) {
+			diff->path[path_bytes++] = '/';
+			if (tree_diff_walk(diff, path_bytes, (uint8_t *) entry_a.sha1,
+						(uint8_t *) entry_b.sha1) < 0)
+				goto done;
+		} else if (compare == 0) {
+			if (tree_diff_change(diff, path_bytes, entry_a.mode, entry_a.sha1,
+						entry_b.mode, entry_b.sha1) < 0)
+				goto done;
+		} else if (compare < 0 && tree_a) {
+			diff->path[path_bytes++] = '/';
+			if (tree_diff_walk(diff, path_bytes, (uint8_t *) entry_a.sha1,
+						NULL) < 0)
+				goto done;
+		} else if (compare < 0) {
+			if (tree_diff_change(diff, path_bytes, entry_a.mode, entry_a.sha1,
+						0, null_sha1) < 0)
+				goto done;
+		} else if (tree_b) {
+			diff->path[path_bytes++] = '/';
+			if (tree_diff_walk(diff, path_bytes, NULL,
+						(uint8_t *) entry_b.sha1) < 0)
+				goto done;
+		} else {
+			if (tree_diff_change(diff, path_bytes, 0, null_sha1,
+						entry_b.mode, entry_b.sha1) < 0)
+				goto done;
+		}
+
+next:
+		if (compare <= 0)
+			next_a = tree_entry_next(&data_a, end_a, &entry_a);
+		if (compare >= 0)
+			next_b = tree_entry_next(&data_b, end_b, &entry_b);
+	}
+	result = 0;
+
+done:
+	if (a)
+		object_cache_put(a);
+	if (b)
+		object_cache_put(b);
+	return result;
+
+fail_error:
+	fprintf(stderr, "%s\n", error);
+	free(error);
+	goto done;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tree_diff diff;
+	const char *trees[2];
+	uint8_t sha1_a[20], sha1_b[20];
+	int trees_count;
+	int i;
+
+	memset(&diff, 0, sizeof(diff));
+	diff.output = TREE_DIFF_RAW;
+	trees_count = 0;
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		if (!strncmp(arg, "--name-only", sizeof("--name-only"))) {
+			diff.output = TREE_DIFF_NAME_ONLY;
+			continue;
+		}
+		if (!strncmp(arg, "--name-status", sizeof("--name-status"))) {
+			diff.output = TREE_DIFF_NAME_STATUS;
+			continue;
+		}
+		if (arg[0] == '-')
+			return usage(argv[0], 1, "Unknown option '%s'", arg);
+		if (trees_count == 2)
+			return usage(argv[0], 1, "too many trees");
+		trees[trees_count++] = arg;
+	}
+	if (trees_count != 2)
+		return usage(argv[0], 1, "two trees are needed");
+	if (hex2sha1(trees[0], sha1_a) < 0)
+		return usage(argv[0], 1, "invalid sha1 '%s'", trees[0]);
+	if (hex2sha1(trees[1], sha1_b) < 0)
+		return usage(argv[0], 1, "invalid sha1 '%s'", trees[1]);
+
+	if (buffer_init(&diff.out) < 0)
+		return 1;
+	if (tree_diff_walk(&diff, 0, sha1_a, sha1_b) < 0)
+		return 1;
+	if (buffer_flush(&diff.out, 0) < 0)
+		return 1;
+	buffer_uninit(&diff.out);
+
+	return 0;
+}
@@ -1,163 +1,556 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "index.h"
+#include "linediff.h"
+#include "monitor.h"
 
-#define CTIME_CHANGED 0x01
-#define MTIME_CHANGED 0x02
-#define INODE_CHANGED 0x04
-#define MODE_CHANGED  0x08
-#define OWNER_CHANGED 0x10
-#define SIZE_CHANGED  0x20
+/* preload results, besides the changes */
+#define ENTRY_CLEAN   0x40
+#define ENTRY_MISSING 0x80
 
-int stat_changed(struct index_entry *entry, struct stat *st)
+/* Entries are stat'ed by slices of the index, one per thread, before the
+ * output is produced in index order. A thread takes at least that many. */
+#define PRELOAD_MIN_ENTRIES	1000
+
+/* what is shown of the changes */
+#define OUTPUT_PATCH		0
+#define OUTPUT_NAME_ONLY	1
+#define OUTPUT_NAME_STATUS	2
+#define OUTPUT_NUMSTAT		3
+#define OUTPUT_STAT		4
+
+/* columns of a --stat line, and of its graph at least */
+#define STAT_WIDTH		80
+#define STAT_GRAPH_MIN_WIDTH	6
+
+struct diff_pair {
+	struct linediff_file a;
+	struct linediff_file b;
+	const struct cached_object *object;
+	void *map;
+};
+
+struct diff_stat {
+	char *path;
+	uint32_t added;
+	uint32_t deleted;
+	int binary;
+};
+
+struct preload {
+	struct index *index;
+	/* from the monitor, NULL to stat every entry */
+	struct monitor_changes *changes;
+	/* for each entry, see entry_check() */
+	int *results;
+	uint32_t start;
+	uint32_t end;
+};
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
 {
-	int changes = 0;
-
-	if (entry->ctime.seconds != st->st_ctim.tv_sec)
-		changes |= CTIME_CHANGED;
-	if (entry->mtime.seconds != st->st_mtim.tv_sec)
-		changes |= MTIME_CHANGED;
-	if (entry->st_dev != st->st_dev ||
-			entry->st_ino != st->st_ino)
-		changes |= INODE_CHANGED;
-	if (entry->st_mode != st->st_mode)
-		changes |= MODE_CHANGED;
-	if (entry->st_uid != st->st_uid ||
-			entry->st_gid != st->st_gid)
-		changes |= OWNER_CHANGED;
-	if (entry->st_size != st->st_size)
-		changes |= SIZE_CHANGED;
-
-	return changes;
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h] [--jobs|-j <n>] [--patience] [--name-only|--name-status|--numstat|--stat]\n", program);
+
+	return return_value;
 }
 
-static int diff_empty_show(struct index_entry *entry)
+/* Compare the content of the file with the entry's object */
+static int content_changed(struct index_entry *entry, const char *path)
 {
 	char *error;
-	uint8_t *buffer;
-	uint8_t *c;
-	uint64_t buffer_bytes;
-	int line;
-	int newline;
-
-	buffer = file_sha1_read(entry->sha1, &buffer_bytes, &error);
-	if (!buffer) {
-		fprintf(stderr, "Can't open sha1 file '%s': %s\n",
-				sha12hex(entry->sha1), error);
+	uint8_t sha1[20];
+	int fd;
+	int result;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	result = fd_hash(fd, 0, sha1, &error);
+	close(fd);
+	if (result < 0) {
 		free(error);
-		return -1;
+		return 1;
 	}
 
-	c = buffer;
-	line = 0;
-	while (c != buffer + buffer_bytes) {
-		if (*c == '\n')
-			line++;
-		c++;
-	}
+	return memcmp(sha1, entry->sha1, sizeof(sha1)) != 0;
+}
+
+/* The changes of the stat data, ENTRY_CLEAN when the file is known not to
+ * have changed (from the monitor, its stat data or its content),
+ * ENTRY_MISSING, or -errno when stat(2) failed */
+static int entry_check(struct index *index, struct monitor_changes *changes,
+		struct index_entry *entry)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int changed;
+
+	if (changes && !index_monitor_dirty(index, entry) &&
+			!monitor_changed(changes, entry->name, entry->name_bytes))
+		return ENTRY_CLEAN;
+
+	/* names are not NUL terminated in the index */
+	snprintf(path, sizeof(path), "%.*s", entry->name_bytes, entry->name);
+	if (stat(path, &st) < 0)
+		return errno == ENOENT ? ENTRY_MISSING : -errno;
+
+	/* clean, unless it was modified right after being staged */
+	changed = stat_changed(entry, &st);
+	if (!changed && !index_entry_racy(index, entry))
+		return ENTRY_CLEAN;
+	/* a different size is a change for sure, unless the entry was smudged,
+	 * otherwise check the content as the stat data may have changed alone
+	 * (touch, chmod, copy) */
+	if ((!(changed & SIZE_CHANGED) || !entry->st_size) &&
+			!content_changed(entry, path))
+		return ENTRY_CLEAN;
 
-	fprintf(stdout , "--- %s\n", entry->name);
-	fprintf(stdout , "+++ /dev/null\n");
-	fprintf(stdout, "@@ -1,%d +0,0 @@\n", line);
+	return changed;
+}
+
+static void *preload_worker(void *data)
+{
+	struct preload *preload = data;
+	uint32_t i;
+
+	for (i = preload->start; i < preload->end; i++)
+		preload->results[i] = entry_check(preload->index, preload->changes,
+				preload->index->entries[i]);
 
-	c = buffer;
-	newline = 1;
-	while (c != buffer + buffer_bytes) {
-		if (newline) {
-			fprintf(stdout, "-");
-			newline = 0;
+	return NULL;
+}
+
+/* Check every entry, by up to jobs threads */
+static int *preload_index(struct index *index,
+		struct monitor_changes *changes, int jobs)
+{
+	struct preload *preloads;
+	pthread_t *threads;
+	int *results;
+	uint32_t slice;
+	int started;
+	int i;
+
+	results = malloc((index->entries_count + 1) * sizeof(int));
+	if (!results) {
+		fprintf(stderr, "malloc fail: %m\n");
+		return NULL;
+	}
+	if (jobs > index->entries_count / PRELOAD_MIN_ENTRIES)
+		jobs = index->entries_count / PRELOAD_MIN_ENTRIES;
+	if (jobs < 1)
+		jobs = 1;
+	preloads = calloc(jobs, sizeof(*preloads));
+	threads = calloc(jobs, sizeof(*threads));
+	if (!preloads || !threads) {
+		fprintf(stderr, "calloc fail: %m\n");
+		free(preloads);
+		free(threads);
+		free(results);
+		return NULL;
+	}
+
+	slice = (index->entries_count + jobs - 1) / jobs;
+	for (i = 0; i < jobs; i++) {
+		preloads[i].index = index;
+		preloads[i].changes = changes;
+		preloads[i].results = results;
+		preloads[i].start = i * slice;
+		preloads[i].end = i == jobs - 1 ? index->entries_count :
+			(i + 1) * slice;
+	}
+	/* the main thread takes the first slice */
+	for (started = 1; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, preload_worker,
+					&preloads[started]) != 0) {
+			fprintf(stderr, "pthread_create fail: %m\n");
+			break;
 		}
-		fprintf(stdout, "%c", *c);
-		if (*c == '\n')
-			newline = 1;
-		c++;
 	}
+	preload_worker(&preloads[0]);
+	/* and those left without a thread */
+	for (i = started; i < jobs; i++)
+		preload_worker(&preloads[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
 
-	free(buffer);
+	free(preloads);
+	free(threads);
 
-	return 0;
+	return results;
 }
 
-static int diff_show(uint8_t *sha1, const char *filename)
+/* The two sides of a changed entry: its object, and the file at path or
+ * nothing when it was deleted */
+static int diff_pair_load(struct diff_pair *pair, struct index_entry *entry,
+		const char *path, int deleted)
 {
+	struct stat st;
 	char *error;
-	FILE *f;
-	uint8_t *buffer;
-	uint64_t buffer_bytes;
-	char diff_command[128];
+	int fd;
 
-	buffer = file_sha1_read(sha1, &buffer_bytes, &error);
-	if (!buffer) {
+	memset(pair, 0, sizeof(*pair));
+	pair->object = object_cache_get(entry->sha1, &error);
+	if (!pair->object) {
 		fprintf(stderr, "fail to read sha1 blob '%s': %s\n",
-				sha12hex(sha1), error);
+				sha12hex(entry->sha1), error);
 		free(error);
 		return -1;
 	}
+	pair->a.label = path;
+	pair->a.data = pair->object->data;
+	pair->a.bytes = pair->object->bytes;
+	pair->b.label = deleted ? "/dev/null" : path;
+	if (deleted)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "open '%s' fail: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	if (st.st_size > 0) {
+		pair->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (pair->map == MAP_FAILED) {
+			fprintf(stderr, "mmap '%s' fail: %s\n", path, strerror(errno));
+			pair->map = NULL;
+			goto fail;
+		}
+		pair->b.data = pair->map;
+		pair->b.bytes = st.st_size;
+	}
+	close(fd);
+
+	return 0;
 
-	snprintf(diff_command, sizeof(diff_command), "diff -L %s -Nu - %s", filename, filename);
-	f = popen(diff_command, "w");
-	if (!f) {
-		fprintf(stderr, "popen fail: %s\n", strerror(errno));
+fail:
+	if (fd >= 0)
+		close(fd);
+	object_cache_put(pair->object);
+	return -1;
+}
+
+static void diff_pair_release(struct diff_pair *pair)
+{
+	if (pair->map)
+		munmap(pair->map, pair->b.bytes);
+	object_cache_put(pair->object);
+}
+
+/* Diff the entry's object with the file at path, or with nothing when the
+ * file was deleted */
+static int diff_show(struct buffer *out, struct index_entry *entry,
+		const char *path, int deleted, int algorithm)
+{
+	struct diff_pair pair;
+	char *error;
+	int result;
+
+	if (diff_pair_load(&pair, entry, path, deleted) < 0)
 		return -1;
+	result = linediff_unified(out, &pair.a, &pair.b, algorithm, &error);
+	if (result < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
 	}
+	diff_pair_release(&pair);
 
-	while (buffer_bytes > 0) {
-		size_t written;
+	return result;
+}
 
-		written = fwrite(buffer, sizeof(char), buffer_bytes, f);
-		if (written < 0) {
-			fprintf(stderr, "fwrite fail: %s\n", strerror(errno));
-			pclose(f);
-			free(buffer);
-			return -1;
-		}
-		buffer_bytes -= written;
+/* Count the lines added and deleted, 1 for a binary file */
+static int diff_count(struct diff_stat *stat, struct index_entry *entry,
+		const char *path, int deleted, int algorithm)
+{
+	struct diff_pair pair;
+	char *error;
+	int result;
+
+	if (diff_pair_load(&pair, entry, path, deleted) < 0)
+		return -1;
+	result = linediff_count(&pair.a, &pair.b, algorithm, &stat->added,
+			&stat->deleted, &error);
+	if (result < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
 	}
+	diff_pair_release(&pair);
+	stat->binary = result == 1;
 
-	pclose(f);
-	free(buffer);
+	return result;
+}
 
-	return 0;
+static int decimal_width(uint32_t n)
+{
+	int width;
+
+	for (width = 1; n >= 10; n /= 10)
+		width++;
+
+	return width;
+}
+
+/* " path | count +++---" per file, the graph scaled down to fit in
+ * STAT_WIDTH columns, then the totals */
+static int stat_show(struct buffer *out, struct diff_stat *stats, size_t count)
+{
+	uint32_t added, deleted, max_changes;
+	int name_width, count_width, graph_width;
+	size_t i;
+
+	added = deleted = max_changes = 0;
+	name_width = 0;
+	for (i = 0; i < count; i++) {
+		uint32_t changes = stats[i].added + stats[i].deleted;
+
+		if (strlen(stats[i].path) > name_width)
+			name_width = strlen(stats[i].path);
+		if (changes > max_changes)
+			max_changes = changes;
+		added += stats[i].added;
+		deleted += stats[i].deleted;
+	}
+	count_width = decimal_width(max_changes);
+	if (count_width < 3)
+		count_width = 3;	/* for "Bin" */
+	graph_width = STAT_WIDTH - name_width - count_width - 5;
+	if (graph_width < STAT_GRAPH_MIN_WIDTH)
+		graph_width = STAT_GRAPH_MIN_WIDTH;
+
+	for (i = 0; i < count; i++) {
+		struct diff_stat *stat = &stats[i];
+		uint32_t plus = stat->added, minus = stat->deleted;
+
+		if (stat->binary) {
+			if (buffer_sprintf(out, " %-*s | %*s\n", name_width,
+						stat->path, count_width, "Bin") < 0)
+				return -1;
+			continue;
+		}
+		if (max_changes > graph_width) {
+			/* keep at least one sign of each kind */
+			plus = (uint64_t) plus * graph_width / max_changes;
+			minus = (uint64_t) minus * graph_width / max_changes;
+			if (stat->added && !plus)
+				plus = 1;
+			if (stat->deleted && !minus)
+				minus = 1;
+		}
+		if (buffer_sprintf(out, " %-*s | %*u ", name_width, stat->path,
+					count_width, stat->added + stat->deleted) < 0)
+			return -1;
+		while (plus--)
+			if (buffer_concat(out, "+", 1) < 0)
+				return -1;
+		while (minus--)
+			if (buffer_concat(out, "-", 1) < 0)
+				return -1;
+		if (buffer_concat(out, "\n", 1) < 0)
+			return -1;
+	}
+
+	return buffer_sprintf(out, " %zu file%s changed, %u insertion%s(+), %u deletion%s(-)\n",
+			count, count == 1 ? "" : "s", added, added == 1 ? "" : "s",
+			deleted, deleted == 1 ? "" : "s");
 }
 
 int main(int argc, char *argv[])
 {
-	int i;
+	uint32_t i;
+	int j;
+	int jobs;
+	long value;
+	char *end;
+	int algorithm;
+	int output;
+	int deleted;
+	int result;
+	int failed;
+	struct diff_stat stat;
+	struct diff_stat *stats;
+	size_t stats_count, stats_allocated;
+	struct buffer out;
 	struct index *index;
+	struct monitor_changes changes;
+	int monitor;
+	int *results;
 	char *error;
 
-	index = index_open(&error);
+	/* 0 means one job per online cpu */
+	jobs = 0;
+	algorithm = LINEDIFF_MYERS;
+	output = OUTPUT_PATCH;
+	for (j = 1; j < argc; j++) {
+		const char *arg = argv[j];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		if (!strncmp(arg, "--jobs", sizeof("--jobs")) ||
+				!strncmp(arg, "-j", sizeof("-j"))) {
+			if (j + 1 == argc)
+				return usage(argv[0], 1, "missing number of jobs");
+			value = strtol(argv[++j], &end, 10);
+			if (end == argv[j] || *end || value < 0 || value > INT_MAX)
+				return usage(argv[0], 1, "invalid number of jobs '%s'",
+						argv[j]);
+			jobs = value;
+			continue;
+		}
+		if (!strncmp(arg, "--patience", sizeof("--patience"))) {
+			algorithm = LINEDIFF_PATIENCE;
+			continue;
+		}
+		if (!strncmp(arg, "--name-only", sizeof("--name-only"))) {
+			output = OUTPUT_NAME_ONLY;
+			continue;
+		}
+		if (!strncmp(arg, "--name-status", sizeof("--name-status"))) {
+			output = OUTPUT_NAME_STATUS;
+			continue;
+		}
+		if (!strncmp(arg, "--numstat", sizeof("--numstat"))) {
+			output = OUTPUT_NUMSTAT;
+			continue;
+		}
+		if (!strncmp(arg, "--stat", sizeof("--stat"))) {
+			output = OUTPUT_STAT;
+			continue;
+		}
+		return usage(argv[0], 1, "Unknown option '%s'", arg);
+	}
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	index = index_open_readonly(&error);
 	if (!index) {
 		fprintf(stderr, "%s\n", error);
 		free(error);
 		return 1;
 	}
 
+	/* with a daemon, only the entries which may have changed are stat'ed */
+	monitor = index->monitor_token &&
+		!monitor_query(index->monitor_token, &changes, NULL) &&
+		!changes.everything;
+	results = preload_index(index, monitor ? &changes : NULL, jobs);
+	stats = NULL;
+	stats_count = stats_allocated = 0;
+	failed = 0;
+	if (!results || buffer_init(&out) < 0)
+		return 1;
+
 	for (i = 0; i < index->entries_count; i++) {
 		struct index_entry *entry = index->entries[i];
-		struct stat st;
-		int changes;
+		char path[PATH_MAX];
+		int changed = results[i];
 
-		if (stat(entry->name, &st) < 0) {
-			if (errno != ENOENT) {
-				fprintf(stderr, "stat(2) fail: %s\n", strerror(errno));
-				return 1;
-			}
-			diff_empty_show(entry);
+		if (changed == ENTRY_CLEAN)
 			continue;
+		if (changed < 0) {
+			fprintf(stderr, "stat(2) fail: %s\n", strerror(-changed));
+			return 1;
 		}
+		snprintf(path, sizeof(path), "%.*s", entry->name_bytes, entry->name);
+		deleted = changed == ENTRY_MISSING;
+		/* the names need nothing more than the checks already done */
+		switch (output) {
+		case OUTPUT_NAME_ONLY:
+			result = buffer_sprintf(&out, "%s\n", path);
+			break;
+		case OUTPUT_NAME_STATUS:
+			result = buffer_sprintf(&out, "%c\t%s\n",
+					deleted ? 'D' : 'M', path);
+			break;
+		case OUTPUT_NUMSTAT:
+			result = 0;
+			/* reported, the other files are still shown */
+			if (diff_count(&stat, entry, path, deleted, algorithm) < 0) {
+				failed = 1;
+				break;
+			}
+			if (stat.binary)
+				result = buffer_sprintf(&out, "-\t-\t%s\n", path);
+			else
+				result = buffer_sprintf(&out, "%u\t%u\t%s\n",
+						stat.added, stat.deleted, path);
+			break;
+		case OUTPUT_STAT:
+			result = 0;
+			if (stats_count == stats_allocated) {
+				struct diff_stat *grown;
 
-		changes = stat_changed(entry, &st);
-		if (changes)
-			diff_show(entry->sha1, entry->name);
+				stats_allocated = stats_allocated ?
+					2 * stats_allocated : 64;
+				grown = realloc(stats, stats_allocated * sizeof(*stats));
+				if (!grown) {
+					fprintf(stderr, "realloc fail: %m\n");
+					return 1;
+				}
+				stats = grown;
+			}
+			if (diff_count(&stats[stats_count], entry, path, deleted,
+						algorithm) < 0) {
+				failed = 1;
+				break;
+			}
+			stats[stats_count].path = strdup(path);
+			if (!stats[stats_count].path) {
+				fprintf(stderr, "strdup fail: %m\n");
+				return 1;
+			}
+			stats_count++;
+			break;
+		default:
+			result = 0;
+			if (diff_show(&out, entry, path, deleted, algorithm) < 0)
+				failed = 1;
+			break;
+		}
+		if (result < 0) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		if (buffer_flush(&out, BUFFER_FLUSH_BYTES) < 0)
+			return 1;
 	}
+	/* the widths are known once every file is counted */
+	if (stats_count && stat_show(&out, stats, stats_count) < 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (buffer_flush(&out, 0) < 0)
+		return 1;
+	buffer_uninit(&out);
+	for (i = 0; i < stats_count; i++)
+		free(stats[i].path);
+	free(stats);
+	free(results);
+	if (index->monitor_token)
+		monitor_changes_release(&changes);
 
-	return 0;
+	return failed;
 }
@@ -0,0 +1,504 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "monitor.h"
+
+/* Watches every directory of the working tree (the current directory),
+ * except GT_DIRECTORY, and remembers for each path the sequence number of
+ * its last change. Tokens are "<instance>:<sequence>", the instance telling
+ * tokens of an earlier daemon apart.
+ *
+ * Before answering, the daemon creates a cookie file in GT_DIRECTORY and
+ * waits for its event: inotify queues events in order, so every change made
+ * before the request has been seen by then. */
+
+#define WATCH_MASK	(IN_MODIFY|IN_ATTRIB|IN_CREATE|IN_DELETE|IN_MOVED_FROM| \
+		IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR|IN_DONT_FOLLOW| \
+		IN_EXCL_UNLINK)
+
+struct changed_path {
+	char *path;
+	uint64_t sequence;
+	struct changed_path *next;
+};
+
+static struct {
+	int inotify;
+	char instance[64];
+	uint64_t sequence;
+	/* tokens before it missed events */
+	uint64_t overflow;
+	/* some directory could not be watched */
+	int incomplete;
+	const char *directory;
+	struct stat directory_st;
+	int directory_wd;
+	/* directory of each watch descriptor, "" for the root */
+	char **watches;
+	int watches_count;
+	struct changed_path **buckets;
+	size_t buckets_count;
+	size_t paths_count;
+	uint64_t cookie;
+	int cookie_seen;
+} monitor;
+
+static volatile sig_atomic_t stop;
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
+{
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h]\n", program);
+
+	return return_value;
+}
+
+static void signal_stop(int signum)
+{
+	stop = 1;
+}
+
+static size_t path_hash(const char *path)
+{
+	size_t hash = 2166136261u;
+
+	while (*path)
+		hash = (hash ^ (uint8_t) *path++) * 16777619u;
+
+	return hash & (monitor.buckets_count - 1);
+}
+
+static void paths_grow(void)
+{
+	struct changed_path **buckets, *changed, *next;
+	size_t count, old_count, i;
+
+	if (monitor.paths_count < monitor.buckets_count)
+		return;
+
+	count = monitor.buckets_count ? monitor.buckets_count * 2 : 1024;
+	buckets = calloc(count, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	old_count = monitor.buckets_count;
+	monitor.buckets_count = count;
+	for (i = 0; i < old_count; i++) {
+		for (changed = monitor.buckets[i]; changed; changed = next) {
+			size_t bucket = path_hash(changed->path);
+
+			next = changed->next;
+			changed->next = buckets[bucket];
+			buckets[bucket] = changed;
+		}
+	}
+	free(monitor.buckets);
+	monitor.buckets = buckets;
+}
+
+static void path_changed(const char *path)
+{
+	struct changed_path *changed;
+	size_t bucket;
+
+	monitor.sequence++;
+	paths_grow();
+	if (!monitor.buckets_count) {
+		monitor.overflow = monitor.sequence;
+		return;
+	}
+
+	bucket = path_hash(path);
+	for (changed = monitor.buckets[bucket]; changed; changed = changed->next) {
+		if (!strcmp(changed->path, path)) {
+			changed->sequence = monitor.sequence;
+			return;
+		}
+	}
+	changed = malloc(sizeof(*changed));
+	if (!changed || !(changed->path = strdup(path))) {
+		free(changed);
+		monitor.overflow = monitor.sequence;
+		return;
+	}
+	changed->sequence = monitor.sequence;
+	changed->next = monitor.buckets[bucket];
+	monitor.buckets[bucket] = changed;
+	monitor.paths_count++;
+}
+
+static int watch_set(int wd, const char *path)
+{
+	if (wd >= monitor.watches_count) {
+		int count = wd + 1 > 2 * monitor.watches_count ?
+			wd + 1 : 2 * monitor.watches_count;
+		char **ptr;
+
+		ptr = realloc(monitor.watches, count * sizeof(char *));
+		if (!ptr)
+			return -1;
+		memset(ptr + monitor.watches_count, 0,
+				(count - monitor.watches_count) * sizeof(char *));
+		monitor.watches = ptr;
+		monitor.watches_count = count;
+	}
+	free(monitor.watches[wd]);
+	monitor.watches[wd] = strdup(path);
+
+	return monitor.watches[wd] ? 0 : -1;
+}
+
+/* Watch path and the directories below it, path being "" for the root */
+static void watch_tree(const char *path)
+{
+	char child[PATH_MAX];
+	struct dirent *dirent;
+	struct stat st;
+	DIR *dir;
+	int wd;
+
+	wd = inotify_add_watch(monitor.inotify, *path ? path : ".", WATCH_MASK);
+	if (wd < 0) {
+		/* gone already, or out of watches */
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr, "inotify_add_watch '%s' fail: %m\n", path);
+			monitor.incomplete = 1;
+		}
+		return;
+	}
+	if (watch_set(wd, path) < 0) {
+		monitor.incomplete = 1;
+		return;
+	}
+
+	dir = opendir(*path ? path : ".");
+	if (!dir)
+		return;
+	while ((dirent = readdir(dir))) {
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+		if (dirent->d_type != DT_DIR && dirent->d_type != DT_UNKNOWN)
+			continue;
+		snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "",
+				dirent->d_name);
+		if (lstat(child, &st) < 0 || !S_ISDIR(st.st_mode))
+			continue;
+		if (st.st_dev == monitor.directory_st.st_dev &&
+				st.st_ino == monitor.directory_st.st_ino)
+			continue;
+		watch_tree(child);
+	}
+	closedir(dir);
+}
+
+/* A directory moved away: its watches would keep reporting the old path */
+static void unwatch_tree(const char *path)
+{
+	size_t bytes = strlen(path);
+	int wd;
+
+	for (wd = 0; wd < monitor.watches_count; wd++) {
+		const char *watched = monitor.watches[wd];
+
+		if (!watched || strncmp(watched, path, bytes) ||
+				(watched[bytes] != '\0' && watched[bytes] != '/'))
+			continue;
+		inotify_rm_watch(monitor.inotify, wd);
+		free(monitor.watches[wd]);
+		monitor.watches[wd] = NULL;
+	}
+}
+
+static void event_handle(struct inotify_event *event)
+{
+	char path[PATH_MAX];
+	char cookie[64];
+	const char *directory;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		fprintf(stderr, "inotify queue overflow\n");
+		monitor.overflow = ++monitor.sequence;
+		return;
+	}
+	if (event->wd == monitor.directory_wd) {
+		snprintf(cookie, sizeof(cookie), "%s.%" PRIu64, MONITOR_COOKIE,
+				monitor.cookie);
+		if ((event->mask & IN_CREATE) && event->len &&
+				!strcmp(event->name, cookie))
+			monitor.cookie_seen = 1;
+		return;
+	}
+	if (event->wd < 0 || event->wd >= monitor.watches_count ||
+			!(directory = monitor.watches[event->wd]))
+		return;
+	if (event->mask & IN_IGNORED) {
+		free(monitor.watches[event->wd]);
+		monitor.watches[event->wd] = NULL;
+		return;
+	}
+	if (!event->len) {
+		/* the root itself went away */
+		if (!*directory && (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF)))
+			monitor.overflow = ++monitor.sequence;
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s%s%s", directory, *directory ? "/" : "",
+			event->name);
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & IN_MOVED_FROM)
+			unwatch_tree(path);
+		if (event->mask & (IN_CREATE|IN_MOVED_TO))
+			watch_tree(path);
+	}
+	path_changed(path);
+}
+
+static int events_read(void)
+{
+	char buffer[64 * 1024]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t n;
+	char *p;
+
+	n = read(monitor.inotify, buffer, sizeof(buffer));
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	for (p = buffer; p < buffer + n; p += sizeof(*event) + event->len) {
+		event = (struct inotify_event *) p;
+		event_handle(event);
+	}
+
+	return 0;
+}
+
+/* Wait until the events of every change made so far are read */
+static int events_sync(void)
+{
+	char path[PATH_MAX];
+	struct pollfd pollfd = { .fd = monitor.inotify, .events = POLLIN };
+	int fd;
+
+	monitor.cookie++;
+	monitor.cookie_seen = 0;
+	snprintf(path, sizeof(path), "%s/%s.%" PRIu64, monitor.directory,
+			MONITOR_COOKIE, monitor.cookie);
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	while (!monitor.cookie_seen) {
+		if (poll(&pollfd, 1, MONITOR_TIMEOUT_MS) <= 0 || events_read() < 0)
+			break;
+	}
+	unlink(path);
+
+	return monitor.cookie_seen ? 0 : -1;
+}
+
+static int answer_write(int fd, const char *data, size_t bytes)
+{
+	return exact_write(fd, data, bytes, NULL);
+}
+
+static void client_answer(int fd)
+{
+	char request[256];
+	char token[128];
+	char *separator, *end;
+	uint64_t since;
+	size_t i;
+	ssize_t n;
+	size_t rd;
+	int everything;
+	struct changed_path *changed;
+
+	rd = 0;
+	for (;;) {
+		struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pollfd, 1, MONITOR_TIMEOUT_MS) <= 0)
+			return;
+		n = read(fd, request + rd, sizeof(request) - 1 - rd);
+		if (n <= 0)
+			return;
+		rd += n;
+		request[rd] = '\0';
+		if ((end = strchr(request, '\n')))
+			break;
+		if (rd == sizeof(request) - 1)
+			return;
+	}
+	*end = '\0';
+
+	everything = events_sync() < 0 || monitor.incomplete;
+	separator = strrchr(request, ':');
+	if (!separator || separator - request != strlen(monitor.instance) ||
+			strncmp(request, monitor.instance, separator - request))
+		everything = 1;
+	else {
+		since = strtoull(separator + 1, &end, 10);
+		if (*end || since < monitor.overflow || since > monitor.sequence)
+			everything = 1;
+	}
+
+	snprintf(token, sizeof(token), "%s:%" PRIu64, monitor.instance,
+			monitor.sequence);
+	if (answer_write(fd, token, strlen(token) + 1) < 0)
+		return;
+	if (everything) {
+		answer_write(fd, "/", 2);
+		return;
+	}
+	for (i = 0; i < monitor.buckets_count; i++) {
+		for (changed = monitor.buckets[i]; changed; changed = changed->next) {
+			if (changed->sequence <= since)
+				continue;
+			if (answer_write(fd, changed->path,
+						strlen(changed->path) + 1) < 0)
+				return;
+		}
+	}
+}
+
+/* Take over the socket of a daemon which died, not of a running one */
+static int socket_listen(struct sockaddr_un *address)
+{
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket fail: %m\n");
+		return -1;
+	}
+	if (!connect(fd, (struct sockaddr *) address, sizeof(*address))) {
+		fprintf(stderr, "a monitor already listens on '%s'\n",
+				address->sun_path);
+		close(fd);
+		return -1;
+	}
+	unlink(address->sun_path);
+	if (bind(fd, (struct sockaddr *) address, sizeof(*address)) < 0 ||
+			listen(fd, 16) < 0) {
+		fprintf(stderr, "listen '%s' fail: %m\n", address->sun_path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un address;
+	struct sigaction action;
+	struct pollfd pollfds[2];
+	int listener;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		return usage(argv[0], 1, "Unknown option '%s'", arg);
+	}
+
+	if (!(monitor.directory = getenv("GT_DIRECTORY")))
+		monitor.directory = GT_DEFAULT_DIRECTORY;
+	if (stat(monitor.directory, &monitor.directory_st) < 0) {
+		fprintf(stderr, "stat '%s' fail: %m\n", monitor.directory);
+		return 1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (monitor_socket_path(address.sun_path, sizeof(address.sun_path)) < 0) {
+		fprintf(stderr, "monitor socket path too long\n");
+		return 1;
+	}
+
+	monitor.inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (monitor.inotify < 0) {
+		fprintf(stderr, "inotify_init1 fail: %m\n");
+		return 1;
+	}
+	snprintf(monitor.instance, sizeof(monitor.instance), "%ld.%ld",
+			(long) getpid(), (long) time(NULL));
+	monitor.directory_wd = inotify_add_watch(monitor.inotify,
+			monitor.directory, IN_CREATE|IN_ONLYDIR);
+	if (monitor.directory_wd < 0) {
+		fprintf(stderr, "inotify_add_watch '%s' fail: %m\n",
+				monitor.directory);
+		return 1;
+	}
+	watch_tree("");
+
+	listener = socket_listen(&address);
+	if (listener < 0)
+		return 1;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pollfds[0].fd = monitor.inotify;
+	pollfds[0].events = POLLIN;
+	pollfds[1].fd = listener;
+	pollfds[1].events = POLLIN;
+	while (!stop) {
+		if (poll(pollfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll fail: %m\n");
+			break;
+		}
+		if ((pollfds[0].revents & POLLIN) && events_read() < 0) {
+			fprintf(stderr, "read inotify fail: %m\n");
+			break;
+		}
+		if (pollfds[1].revents & POLLIN) {
+			int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd >= 0) {
+				client_answer(fd);
+				close(fd);
+			}
+		}
+	}
+
+	unlink(address.sun_path);
+	close(listener);
+
+	return 0;
+}
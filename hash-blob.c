@@ -9,7 +9,6 @@
 #include <unistd.h>
 
 #include "index.h"
-#include "common.h"
 
 static int usage(const char *program, 
 		int return_value,
@@ -35,10 +34,8 @@ int main(int argc, char *argv[])
 	int stop_options;
 	int write;
 	const char *filename;
-	uint8_t *buffer;
 	char *error;
 	uint8_t sha1[20];
-	size_t bytes;
 
 	write = stop_options = 0;
 	filename = NULL;
@@ -83,8 +80,8 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (fd_read(fd, &buffer, &bytes, &error) < 0) {
-		fprintf(stderr, "%s", error);
+	if (fd_hash(fd, write, sha1, &error) < 0) {
+		fprintf(stderr, "%s\n", error);
 		free(error);
 		return 1;
 	}
@@ -92,16 +89,7 @@ int main(int argc, char *argv[])
 	if (fd != STDIN_FILENO)
 		close(fd);
 
-	if (object_hash(buffer, bytes, "blob", write, sha1, &error) < 0) {
-		fprintf(stderr, "%s\n", error);
-		free(buffer);
-		free(error);
-		return 1;
-	}
-
 	fprintf(stdout, "%s\n", sha12hex(sha1));
 
-	free(buffer);
-
 	return 0;
 }
@@ -1,8 +1,10 @@
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <linux/limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,10 +14,17 @@
 #include <unistd.h>
 
 #include <openssl/sha.h>
-#include <zlib.h>
 
+#include "cache.h"
+#include "codec.h"
 #include "common.h"
+#include "config.h"
+#include "crc32c.h"
+#include "delta.h"
 #include "index.h"
+#include "monitor.h"
+#include "pack.h"
+#include "tree.h"
 
 /* The index represents a place where you want to put your files before commiting.
  * It is a staging area where the new commit is prepared. The entries in the
@@ -23,25 +32,61 @@
 
 #define GT_DEFAULT_DIRECTORY "./.gt"
 
-static int index_header_check(struct index_header *header, size_t size)
+static int index_header_check(struct index_header *header)
 {
-	SHA_CTX ctx;
-	uint8_t sha1[20];
+	uint32_t version = header->version & GT_VERSION_MASK;
 
 	if (header->signature != GT_SIGNATURE)
 		return 0;
-	if (header->version != GT_VERSION)
+	if (version != GT_VERSION && version != GT_VERSION_2)
 		return 0;
 
+	return 1;
+}
+
+/* Checksum of an index whose header is filled but for the checksum itself */
+static void index_checksum(struct index_header *header, size_t size,
+		uint8_t *checksum)
+{
+	SHA_CTX ctx;
+	uint32_t crc;
+
+	if (header->version & GT_INDEX_CRC32C) {
+		crc = crc32c(0, header, offsetof(struct index_header, sha1));
+		crc = crc32c(crc, header + 1, size - sizeof(struct index_header));
+		memset(checksum, 0, 20);
+		memcpy(checksum, &crc, sizeof(crc));
+		return;
+	}
+
 	SHA1_Init(&ctx);
 	SHA1_Update(&ctx, header, offsetof(struct index_header, sha1));
 	SHA1_Update(&ctx, header + 1, size - sizeof(struct index_header));
-	SHA1_Final(sha1, &ctx);
+	SHA1_Final(checksum, &ctx);
+}
 
-	if (memcmp(header->sha1, sha1, sizeof(sha1)))
-		return 0;
+static int index_checksum_check(struct index_header *header, size_t size)
+{
+	uint8_t checksum[20];
 
-	return 1;
+	index_checksum(header, size, checksum);
+	return !memcmp(header->sha1, checksum, sizeof(checksum));
+}
+
+static int index_verify_mode(void)
+{
+	const char *value;
+
+	value = config_get("index.verify", "GT_INDEX_VERIFY");
+	if (!value || !strcmp(value, "full"))
+		return INDEX_VERIFY_FULL;
+	if (!strcmp(value, "lazy"))
+		return INDEX_VERIFY_LAZY;
+	if (!strcmp(value, "none"))
+		return INDEX_VERIFY_NONE;
+
+	fprintf(stderr, "warning: unknown index.verify '%s', using full\n", value);
+	return INDEX_VERIFY_FULL;
 }
 
 /* make sure the directory ./.gt/objects/xx exists */
@@ -52,7 +97,7 @@ static int object_directory_create(const char *filename, char **error)
 	strcpy(directory, filename);
 	dirname(directory);
 
-	if (mkdir(directory, 0774) < 0) {
+	if (mkdir(directory, 0774) < 0 && errno != EEXIST) {
 		asprintf(error, "mkdir '%s' fail: %m", directory);
 		return -1;
 	}
@@ -118,34 +163,9 @@ int exact_write(int fd,
 	return 0;
 }
 
-static int buffer_deflate(uint8_t *buffer, size_t buffer_bytes,
-		uint8_t **deflated, size_t *deflated_bytes)
-{
-	z_stream stream;
-	size_t size;
-
-	memset(&stream, 0, sizeof(stream));
-	deflateInit(&stream, Z_BEST_COMPRESSION);
-	size = deflateBound(&stream, buffer_bytes);
-	*deflated = malloc(size * sizeof(uint8_t));
-	if (!*deflated)
-		return -1;
-
-	stream.next_in = buffer;
-	stream.avail_in = buffer_bytes;
-	stream.next_out = *deflated;
-	stream.avail_out = size;
-	while (deflate(&stream, Z_FINISH) == Z_OK);
-	deflateEnd(&stream);
-	*deflated_bytes = stream.total_out;
-
-	return 0;
-}
-
-char *sha12hex(uint8_t *sha1)
+char *sha12hex_r(uint8_t *sha1, char *sha1_ascii)
 {
 	int i;
-	static char sha1_ascii[41];
 
 	for (i = 0; i < 20; i++) {
 		static char *hex = "0123456789abcdef";
@@ -157,6 +177,13 @@ char *sha12hex(uint8_t *sha1)
 	return sha1_ascii;
 }
 
+char *sha12hex(uint8_t *sha1)
+{
+	static char sha1_ascii[41];
+
+	return sha12hex_r(sha1, sha1_ascii);
+}
+
 static uint8_t hexval(uint8_t c)
 {
 	if (c >= '0' && c <= '9')
@@ -177,7 +204,7 @@ int hex2sha1(const char *hex, uint8_t *sha1)
 		return -1;
 
 	for (i = 0; i < 20; i++) {
-		if (*hex == '\0' || !isxdigit(*hex))
+		if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]))
 			return -1;
 		sha1[i] = (hexval(hex[2 * i]) << 4) & 0xf0;
 		sha1[i] |= hexval(hex[2 * i + 1]) & 0x0f;
@@ -186,31 +213,37 @@ int hex2sha1(const char *hex, uint8_t *sha1)
 	return 0;
 }
 
-char *sha1_filename(uint8_t *sha1)
+char *sha1_filename_r(uint8_t *sha1, char *filename)
 {
 	char *directory;
-	char *sha1_ascii;
-	static char filename[PATH_MAX];
+	char sha1_ascii[41];
 
 	if (!(directory = getenv("GT_DIRECTORY")))
 		directory = GT_DEFAULT_DIRECTORY;
 
-	sha1_ascii = sha12hex(sha1);
+	sha12hex_r(sha1, sha1_ascii);
 	snprintf(filename, PATH_MAX, "%s/objects/%c%c/%s",
 			directory, sha1_ascii[0], sha1_ascii[1], &sha1_ascii[2]);
 
 	return filename;
 }
 
+char *sha1_filename(uint8_t *sha1)
+{
+	static char filename[PATH_MAX];
+
+	return sha1_filename_r(sha1, filename);
+}
+
 void *file_sha1_map(uint8_t *sha1, size_t *map_bytes, char **error)
 {
 	int fd;
 	void *map;
-	const char *filename;
+	char filename[PATH_MAX];
 	struct stat st;
 
 	*map_bytes = 0;
-	filename = sha1_filename(sha1);
+	sha1_filename_r(sha1, filename);
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
 		asprintf(error, "open '%s' fail: %m", filename);
@@ -229,286 +262,2072 @@ void *file_sha1_map(uint8_t *sha1, size_t *map_bytes, char **error)
 	return map;
 }
 
-uint8_t *file_sha1_inflate(void *map, size_t map_bytes, uint64_t *buffer_bytes)
+/* Inflate an object through an already set up stream into *buffer, which is
+ * grown as needed (*allocated bytes) and kept for the next objects. */
+static int object_inflate(struct codec_stream *stream, char *type,
+		uint64_t *buffer_bytes, uint8_t **buffer, size_t *allocated)
 {
 	int result;
 	char chunk[8192];
-	char type[32];
+	char object_type[OBJECT_TYPE_BYTES];
 	int bytes;
-	uint8_t *buffer;
-	z_stream stream;
 
-	memset(&stream, 0, sizeof(stream));
-	stream.next_in = map;
-	stream.avail_in = map_bytes;
-	stream.next_out = (uint8_t *) chunk;
-	stream.avail_out = sizeof(chunk);
+	stream->z.next_out = (uint8_t *) chunk;
+	stream->z.avail_out = sizeof(chunk);
 
-	inflateInit(&stream);
-	result = inflate(&stream, 0);
-	if (sscanf(chunk, "%10s %lu", type, buffer_bytes) != 2)
-		return NULL;
+	result = codec_decompress(stream);
+	if (result < 0 || !memchr(chunk, '\0', stream->z.total_out) ||
+			sscanf(chunk, "%10s %lu", object_type, buffer_bytes) != 2)
+		return -1;
+	if (type)
+		strcpy(type, object_type);
+
+	if (*buffer_bytes > *allocated || !*buffer) {
+		/* room for at least one byte, so that empty objects are not NULL */
+		void *ptr = realloc(*buffer, *buffer_bytes ? *buffer_bytes : 1);
+
+		if (!ptr)
+			return -1;
+		*buffer = ptr;
+		*allocated = *buffer_bytes ? *buffer_bytes : 1;
+	}
 
 	bytes = strlen(chunk) + 1;
-	buffer = malloc(*buffer_bytes);
-	if (!buffer)
-		return NULL;
+	if (stream->z.total_out - bytes > *buffer_bytes)
+		return -1;
+	memcpy(*buffer, chunk + bytes, stream->z.total_out - bytes);
+	bytes = stream->z.total_out - bytes;
+	stream->z.next_out = *buffer + bytes;
+	stream->z.avail_out = *buffer_bytes - bytes;
+	while (result == CODEC_OK && stream->z.avail_out > 0) {
+		uInt avail_in = stream->z.avail_in;
+		uInt avail_out = stream->z.avail_out;
+
+		result = codec_decompress(stream);
+		if (avail_in == stream->z.avail_in && avail_out == stream->z.avail_out)
+			break;
+	}
+
+	if (result < 0 || stream->z.avail_out > 0)
+		return -1;
+
+	return 0;
+}
+
+uint8_t *file_sha1_inflate(void *map, size_t map_bytes,
+		char *type, uint64_t *buffer_bytes)
+{
+	struct codec_stream stream;
+	uint8_t *buffer = NULL;
+	size_t allocated = 0;
+	int result;
 
-	memcpy(buffer, chunk + bytes, stream.total_out - bytes);
-	bytes = stream.total_out - bytes;
-	if (bytes < *buffer_bytes && result == Z_OK) {
-		stream.next_out = buffer + bytes;
-		stream.avail_out = *buffer_bytes - bytes;
-		while (inflate(&stream, Z_FINISH) == Z_OK);
+	if (codec_decompress_init(&stream, map, map_bytes) < 0)
+		return NULL;
+	result = object_inflate(&stream, type, buffer_bytes, &buffer, &allocated);
+	codec_decompress_end(&stream);
+	if (result < 0) {
+		free(buffer);
+		return NULL;
 	}
-	inflateEnd(&stream);
+
 	return buffer;
 }
 
-uint8_t *file_sha1_read(uint8_t *sha1, uint64_t *buffer_bytes, char **error)
+uint8_t *object_read(uint8_t *sha1, char *type, uint64_t *buffer_bytes,
+		char **error)
 {
 	void *map;
 	uint8_t *buffer;
 	size_t map_bytes;
+	struct pack *pack;
+	uint64_t offset;
+
+	if (pack_find(sha1, &pack, &offset))
+		return pack_object_read(pack, offset, type, buffer_bytes, error);
 
 	map = file_sha1_map(sha1, &map_bytes, error);
 	if (!map) {
 		*buffer_bytes = 0;
 		return NULL;
 	}
-	buffer = file_sha1_inflate(map, map_bytes, buffer_bytes);
+	buffer = file_sha1_inflate(map, map_bytes, type, buffer_bytes);
 	munmap(map, map_bytes);
+	if (!buffer) {
+		char hex[41];
+
+		asprintf(error, "corrupt object '%s'", sha12hex_r(sha1, hex));
+	}
 
 	return buffer;
 }
 
-int buffer_sha1_write(uint8_t *sha1,
-		uint8_t *buffer, size_t bytes,
-		char **error)
+void object_reader_init(struct object_reader *reader)
 {
-	char *filename;
-	int fd;
-
-	filename = sha1_filename(sha1);
+	memset(reader, 0, sizeof(*reader));
+}
 
-retry:
-	fd = open(filename, O_CREAT|O_EXCL|O_WRONLY, 0444);
-	if (fd < 0) {
-		if (errno == EEXIST) {
-			return 0;
-		} else if (errno == ENOENT) {
-			if (object_directory_create(filename, error) < 0)
-			 return -1;
-			goto retry;
-		} else {
-			asprintf(error, "open '%s' %m", filename);
-			return -1;
-		}
+uint8_t *object_reader_read(struct object_reader *reader, uint8_t *sha1,
+		char *type, uint64_t *buffer_bytes, char **error)
+{
+	void *map;
+	size_t map_bytes;
+	struct pack *pack;
+	uint64_t offset;
+	char hex[41];
+
+	if (pack_find(sha1, &pack, &offset)) {
+		uint8_t *buffer;
+
+		buffer = pack_object_read(pack, offset, type, buffer_bytes, error);
+		if (!buffer)
+			return NULL;
+		/* the reader owns what it returns */
+		free(reader->buffer);
+		reader->buffer = buffer;
+		reader->allocated = *buffer_bytes;
+		return buffer;
 	}
 
-	if (exact_write(fd, buffer, bytes, error) < 0)
-		return -1;
+	map = file_sha1_map(sha1, &map_bytes, error);
+	if (!map) {
+		*buffer_bytes = 0;
+		return NULL;
+	}
+	if (codec_decompress_reset(&reader->stream, map, map_bytes) < 0 ||
+			object_inflate(&reader->stream, type, buffer_bytes,
+				&reader->buffer, &reader->allocated) < 0) {
+		munmap(map, map_bytes);
+		asprintf(error, "corrupt object '%s'", sha12hex_r(sha1, hex));
+		return NULL;
+	}
+	munmap(map, map_bytes);
 
-	close(fd);
+	return reader->buffer;
+}
 
-	return 0;
+void object_reader_release(struct object_reader *reader)
+{
+	if (reader->stream.codec)
+		codec_decompress_end(&reader->stream);
+	free(reader->buffer);
+	memset(reader, 0, sizeof(*reader));
 }
 
-int buffer_sha1(uint8_t *buffer, size_t bytes,
-		int write, uint8_t *sha1,
-		char **error)
+int object_header_parse(const uint8_t *data, size_t bytes, char *type,
+		uint64_t *size)
 {
-	uint8_t *deflated;
-	size_t deflated_bytes;
-	SHA_CTX ctx;
+	char object_type[OBJECT_TYPE_BYTES];
+	const uint8_t *end;
 
-	buffer_deflate(buffer, bytes, &deflated, &deflated_bytes);
+	end = memchr(data, '\0', bytes);
+	if (!end || sscanf((const char *) data, "%10s %lu", object_type, size) != 2)
+		return -1;
+	if (type)
+		strcpy(type, object_type);
 
-	SHA1_Init(&ctx);
-	SHA1_Update(&ctx, deflated, deflated_bytes);
-	SHA1_Final(sha1, &ctx);
+	return end + 1 - data;
+}
+
+int object_info(uint8_t *sha1, char *type, uint64_t *bytes, char **error)
+{
+	struct pack *pack;
+	uint64_t offset;
+	void *map;
+	size_t map_bytes;
+	uint8_t header[OBJECT_HEADER_BYTES];
+	ssize_t header_bytes;
+	char hex[41];
+
+	if (pack_find(sha1, &pack, &offset))
+		return pack_object_info(pack, offset, type, bytes, error);
 
-	if (write && buffer_sha1_write(sha1, deflated, deflated_bytes, error) < 0) {
-		free(deflated);
+	map = file_sha1_map(sha1, &map_bytes, error);
+	if (!map)
+		return -1;
+	header_bytes = codec_peek(map, map_bytes, header, sizeof(header));
+	munmap(map, map_bytes);
+	if (header_bytes < 0 ||
+			object_header_parse(header, header_bytes, type, bytes) < 0) {
+		asprintf(error, "corrupt object '%s'", sha12hex_r(sha1, hex));
 		return -1;
 	}
 
-	free(deflated);
-
 	return 0;
 }
 
-int file_sha1_write(uint8_t *buffer, size_t bytes, uint8_t *sha1, char **error)
-{
-	return buffer_sha1(buffer, bytes, 1, sha1, error);
-}
-
-int object_hash(uint8_t *buffer, size_t bytes, char *type,
-		int write, uint8_t *sha1,
+int object_stream_open(struct object_stream *stream, uint8_t *sha1,
 		char **error)
 {
-	uint8_t *object;
-	size_t object_bytes;
-	size_t offset;
-	char size_ascii[16];
-
-	sprintf(size_ascii, "%ld", bytes);
-	offset = strlen(type) + strlen(size_ascii) + 2;
-	object_bytes = bytes + offset;
-
-	object = malloc(object_bytes);
-	sprintf((char *) object, "%s %ld", type, bytes);
-	memcpy(object + offset, buffer, bytes);
-
-	if (buffer_sha1(object, object_bytes, write, sha1, error) < 0) {
-		free(object);
-		return -1;
+	uint8_t *data;
+	uint64_t data_bytes;
+	int mapped;
+	int result;
+	int header_bytes;
+	char *end;
+	char hex[41];
+
+	memset(stream, 0, sizeof(*stream));
+	if (!object_raw(sha1, &data, &data_bytes, &mapped)) {
+		struct pack *pack;
+		uint64_t offset;
+
+		/* deltas are only rebuilt in memory */
+		if (!pack_find(sha1, &pack, &offset)) {
+			asprintf(error, "object '%s' not found", sha12hex_r(sha1, hex));
+			return -1;
+		}
+		stream->buffer = pack_object_read(pack, offset, stream->type,
+				&stream->bytes, error);
+		if (!stream->buffer)
+			return -1;
+		stream->remaining = stream->bytes;
+		return 0;
+	}
+	if (mapped) {
+		stream->map = data;
+		stream->map_bytes = data_bytes;
 	}
 
-	free(object);
+	/* inflate no more than the header and the first bytes of the payload */
+	if (codec_decompress_init(&stream->stream, data, data_bytes) < 0)
+		goto corrupt_map;
+	stream->stream.z.next_out = stream->pending;
+	stream->stream.z.avail_out = sizeof(stream->pending);
+	do {
+		uInt avail_out = stream->stream.z.avail_out;
+
+		result = codec_decompress(&stream->stream);
+		end = memchr(stream->pending, '\0', stream->stream.z.total_out);
+		if (avail_out == stream->stream.z.avail_out)
+			break;
+	} while (result == CODEC_OK && !end && stream->stream.z.avail_out > 0);
+
+	if (result < 0 || !end)
+		goto corrupt;
+	stream->pending_bytes = stream->stream.z.total_out;
+	header_bytes = object_header_parse(stream->pending, stream->pending_bytes,
+			stream->type, &stream->bytes);
+	if (header_bytes < 0)
+		goto corrupt;
+	stream->pending_offset = header_bytes;
+	if (stream->pending_bytes - stream->pending_offset > stream->bytes)
+		goto corrupt;
+	stream->remaining = stream->bytes;
+	stream->ended = result == CODEC_END;
 
 	return 0;
+
+corrupt:
+	codec_decompress_end(&stream->stream);
+corrupt_map:
+	if (stream->map)
+		munmap(stream->map, stream->map_bytes);
+	asprintf(error, "corrupt object '%s'", sha12hex_r(sha1, hex));
+	return -1;
 }
 
-struct index *index_open(char **error)
+ssize_t object_stream_read(struct object_stream *stream, void *buffer,
+		size_t bytes, char **error)
 {
-	int fd;
-	int i;
-	size_t size;
-	char filename[PATH_MAX];
-	struct index *index;
-	struct index_header *header;
-	struct stat st;
-	void *map;
-	char *directory;
-	void *offset;
+	size_t produced;
 
-	if (!(directory = getenv("GT_DIRECTORY")))
-		directory = GT_DEFAULT_DIRECTORY;
+	if (bytes > stream->remaining)
+		bytes = stream->remaining;
+	if (bytes == 0)
+		return 0;
 
-	index = calloc(1, sizeof(*index));
-	if (!index) {
-		if (error)
-			asprintf(error, "calloc: %m");
-		return NULL;
+	if (stream->buffer) {
+		memcpy(buffer, stream->buffer + stream->bytes - stream->remaining,
+				bytes);
+		stream->remaining -= bytes;
+		return bytes;
 	}
 
-	snprintf(filename, sizeof(filename), "%s/index", directory);
-	index->path = strdup(filename);
+	if (stream->pending_offset < stream->pending_bytes) {
+		produced = stream->pending_bytes - stream->pending_offset;
+		if (produced > bytes)
+			produced = bytes;
+		memcpy(buffer, stream->pending + stream->pending_offset, produced);
+		stream->pending_offset += produced;
+		stream->remaining -= produced;
+		return produced;
+	}
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			return index;
-		if (error)
-			asprintf(error, "open '%s': %m", filename);
-		return NULL;
+	stream->stream.z.next_out = buffer;
+	stream->stream.z.avail_out = bytes;
+	while (!stream->ended && stream->stream.z.avail_out > 0) {
+		uInt avail_in = stream->stream.z.avail_in;
+		uInt avail_out = stream->stream.z.avail_out;
+		int result;
+
+		result = codec_decompress(&stream->stream);
+		if (result < 0)
+			break;
+		stream->ended = result == CODEC_END;
+		if (avail_in == stream->stream.z.avail_in &&
+				avail_out == stream->stream.z.avail_out)
+			break;
+	}
+	produced = bytes - stream->stream.z.avail_out;
+	if (produced == 0) {
+		asprintf(error, "corrupt object: %lu bytes missing",
+				stream->remaining);
+		return -1;
 	}
+	stream->remaining -= produced;
 
-	map = (void *) -1;
-	if (!fstat(fd, &st)) {
-		size = st.st_size;
-		if (size >= sizeof(struct index_header))
-			map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	return produced;
+}
+
+void object_stream_close(struct object_stream *stream)
+{
+	if (stream->buffer) {
+		free(stream->buffer);
+		return;
 	}
-	close(fd);
-	if (map == (void *) -1) {
-		if (error)
-			asprintf(error, "%m");
+	codec_decompress_end(&stream->stream);
+	if (stream->map)
+		munmap(stream->map, stream->map_bytes);
+}
+
+/* Goes through the object cache, the caller gets its own copy */
+uint8_t *file_sha1_read(uint8_t *sha1, uint64_t *buffer_bytes, char **error)
+{
+	const struct cached_object *object;
+	uint8_t *buffer;
+
+	*buffer_bytes = 0;
+	object = object_cache_get(sha1, error);
+	if (!object)
 		return NULL;
-	}
 
-	header = (struct index_header *) map;
-	if (!index_header_check(header, size)) {
-		munmap(map, size);
+	buffer = malloc(object->bytes ? object->bytes : 1);
+	if (!buffer) {
+		asprintf(error, "malloc fail: %m");
+		object_cache_put(object);
 		return NULL;
 	}
+	memcpy(buffer, object->data, object->bytes);
+	*buffer_bytes = object->bytes;
+	object_cache_put(object);
 
-	index->entries_count = header->entries_count;
-	index->entries = calloc(1, index->entries_count * sizeof(void *));
-	offset = header + 1;
-	for (i = 0; i < index->entries_count; i++) {
-		struct index_entry *entry = offset;
-		size_t entry_bytes = sizeof(*entry) + entry->name_bytes;
+	return buffer;
+}
 
-		index->entries[i] = malloc(entry_bytes);
-		memcpy(index->entries[i], entry, entry_bytes);
-		offset += entry_bytes;
-	}
+int object_exists(uint8_t *sha1)
+{
+	struct stat st;
+	struct pack *pack;
+	uint64_t offset;
+	char filename[PATH_MAX];
 
-	munmap(map, size);
+	if (pack_find(sha1, &pack, &offset))
+		return 1;
 
-	return index;
+	return stat(sha1_filename_r(sha1, filename), &st) == 0;
 }
 
-int index_close(struct index *index, char **error)
+int object_loose_for_each(
+		int (*fn)(uint8_t *sha1, void *data, char **error), void *data,
+		char **error)
 {
-	struct index_header header;
-	int fd;
-	int i;
-	SHA_CTX ctx;
+	char *directory;
+	char objects[PATH_MAX];
+	DIR *top;
+	struct dirent *d;
+	int result;
 
-	fd = open(index->path, O_WRONLY|O_CREAT, 0774);
-	if (fd < 0) {
-		if (error)
-			asprintf(error, "open '%s': %m", index->path);
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(objects, sizeof(objects), "%s/objects", directory);
+
+	top = opendir(objects);
+	if (!top) {
+		asprintf(error, "opendir '%s' fail: %m", objects);
 		return -1;
 	}
 
-	header.signature = GT_SIGNATURE;
-	header.version = GT_VERSION;
-	header.entries_count = index->entries_count;
-	SHA1_Init(&ctx);
-	SHA1_Update(&ctx, &header, offsetof(struct index_header, sha1));
+	result = 0;
+	while (!result && (d = readdir(top))) {
+		char path[2 * PATH_MAX];
+		DIR *sub;
+		struct dirent *o;
 
-	for (i = 0; i < header.entries_count; i++) {
-		struct index_entry *entry = index->entries[i];
-		SHA1_Update(&ctx, entry, sizeof(*entry) + entry->name_bytes);
-	}
-	SHA1_Final(header.sha1, &ctx);
+		if (strlen(d->d_name) != 2 || !isxdigit(d->d_name[0]) ||
+				!isxdigit(d->d_name[1]))
+			continue;
 
-	exact_write(fd, &header, sizeof(header), error);
-	for (i = 0; i < header.entries_count; i++) {
-		struct index_entry *entry = index->entries[i];
-		exact_write(fd, entry, sizeof(*entry) + entry->name_bytes, error);
-		free(entry);
-	}
+		snprintf(path, sizeof(path), "%s/%s", objects, d->d_name);
+		sub = opendir(path);
+		if (!sub)
+			continue;
+		while (!result && (o = readdir(sub))) {
+			char hex[41];
+			uint8_t sha1[20];
 
-	close(fd);
+			if (strlen(o->d_name) != 38)
+				continue;
+			memcpy(hex, d->d_name, 2);
+			memcpy(hex + 2, o->d_name, 39);
+			if (hex2sha1(hex, sha1) < 0)
+				continue;
+			result = fn(sha1, data, error);
+		}
+		closedir(sub);
+	}
+	closedir(top);
 
-	free(index->entries);
-	free(index->path);
-	free(index);
+	return result;
+}
 
-	return 0;
+static int object_format(void)
+{
+	return config_get_int("core.objectformat", "GT_OBJECT_FORMAT",
+			GT_OBJECT_FORMAT);
 }
 
-int fd_hash(int fd,
-		int write, uint8_t *sha1,
+/* Objects are produced through a writer which compresses and hashes its input
+ * chunk by chunk. The compressed stream goes to a temporary file in the
+ * objects directory and is renamed once its sha1 is known, so the memory
+ * needed does not depend on the size of the object. Format 1 objects are
+ * named after the compressed stream, format 2 ones after the uncompressed
+ * stream. */
+struct object_writer {
+	SHA_CTX ctx;
+	struct codec_stream stream;
+	int hash_compressed;
+	int fd;
+	char path[PATH_MAX];
+	uint8_t *chunk;
+};
+
+static int object_writer_init(struct object_writer *writer, int write,
 		char **error)
 {
-	uint8_t *buffer;
-	size_t bytes;
+	char *directory;
+	const struct codec *codec;
+	int level;
 
-	if (fd_read(fd, &buffer, &bytes, error) < 0)
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = -1;
+	writer->hash_compressed = object_format() == 1;
+
+	/* format 1 ids depend on the compressed bytes, keep its historic level */
+	codec = codec_default(&level, writer->hash_compressed ?
+			Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION);
+
+	writer->chunk = malloc(OBJECT_CHUNK_BYTES);
+	if (!writer->chunk) {
+		asprintf(error, "malloc fail: %m");
 		return -1;
+	}
 
-	if (object_hash(buffer, bytes, "blob", write, sha1, error) < 0)
+	if (codec_compress_init(&writer->stream, codec, level) < 0) {
+		asprintf(error, "%s codec init fail", codec->name);
+		free(writer->chunk);
 		return -1;
+	}
+	SHA1_Init(&writer->ctx);
 
-	free(buffer);
+	if (!write)
+		return 0;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(writer->path, sizeof(writer->path), "%s/objects/tmp_obj_XXXXXX",
+			directory);
+	writer->fd = mkstemp(writer->path);
+	if (writer->fd < 0) {
+		asprintf(error, "mkstemp '%s' fail: %m", writer->path);
+		codec_compress_end(&writer->stream);
+		free(writer->chunk);
+		return -1;
+	}
 
 	return 0;
 }
 
-static int name_binary_search(struct index *index, char *name, size_t name_bytes)
+static void object_writer_abort(struct object_writer *writer)
 {
-	int l, r;
+	if (writer->fd >= 0) {
+		close(writer->fd);
+		unlink(writer->path);
+	}
+	codec_compress_end(&writer->stream);
+	free(writer->chunk);
+}
 
-	if (index->entries_count == 0)
-		return -0 - 1;
+static int object_writer_compress(struct object_writer *writer,
+		const void *data, size_t bytes, int finish,
+		char **error)
+{
+	int result;
 
-	l = 0;
+	writer->stream.z.next_in = (uint8_t *) data;
+	writer->stream.z.avail_in = bytes;
+	do {
+		size_t out_bytes;
+
+		writer->stream.z.next_out = writer->chunk;
+		writer->stream.z.avail_out = OBJECT_CHUNK_BYTES;
+		result = codec_compress(&writer->stream, finish);
+		if (result < 0) {
+			asprintf(error, "%s compression fail", writer->stream.codec->name);
+			return -1;
+		}
+
+		out_bytes = OBJECT_CHUNK_BYTES - writer->stream.z.avail_out;
+		if (writer->hash_compressed)
+			SHA1_Update(&writer->ctx, writer->chunk, out_bytes);
+		if (writer->fd >= 0 &&
+				exact_write(writer->fd, writer->chunk, out_bytes, error) < 0)
+			return -1;
+	} while (writer->stream.z.avail_out == 0 ||
+			(finish && result != CODEC_END));
+
+	return 0;
+}
+
+static int object_writer_update(struct object_writer *writer,
+		const void *data, size_t bytes,
+		char **error)
+{
+	if (!writer->hash_compressed)
+		SHA1_Update(&writer->ctx, data, bytes);
+	if (object_writer_compress(writer, data, bytes, 0, error) < 0) {
+		object_writer_abort(writer);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Move a finished temporary file to its object name, creating the fan-out
+ * directory when needed. With sync, the directory is flushed so that the new
+ * name survives a crash. */
+static int object_rename(const char *path, const char *filename, int sync,
+		char **error)
+{
+	char directory[PATH_MAX];
+	int fd;
+
+retry:
+	if (rename(path, filename) < 0) {
+		if (errno == ENOENT) {
+			if (object_directory_create(filename, error) < 0) {
+				unlink(path);
+				return -1;
+			}
+			goto retry;
+		}
+		asprintf(error, "rename '%s' fail: %m", filename);
+		unlink(path);
+		return -1;
+	}
+
+	if (!sync)
+		return 0;
+
+	strcpy(directory, filename);
+	dirname(directory);
+	fd = open(directory, O_RDONLY|O_DIRECTORY);
+	if (fd < 0 || fsync(fd) < 0) {
+		asprintf(error, "fsync '%s' fail: %m", directory);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+int object_fsync_policy(void)
+{
+	const char *value;
+
+	value = config_get("core.fsync", "GT_FSYNC");
+	if (!value || !strcmp(value, "batch"))
+		return OBJECT_FSYNC_BATCH;
+	if (!strcmp(value, "none"))
+		return OBJECT_FSYNC_NONE;
+	if (!strcmp(value, "object"))
+		return OBJECT_FSYNC_OBJECT;
+
+	fprintf(stderr, "warning: unknown core.fsync '%s', using batch\n", value);
+	return OBJECT_FSYNC_BATCH;
+}
+
+/* Objects finished while a batch is open stay under their temporary name
+ * until object_batch_end(), which flushes them all at once before renaming
+ * them: a name never points to data which could be lost in a crash. Workers
+ * may finish objects concurrently. */
+struct object_batch_entry {
+	char *path;
+	char *filename;
+};
+
+static struct {
+	int active;
+	pthread_mutex_t lock;
+	struct object_batch_entry *entries;
+	size_t entries_count;
+	size_t allocated;
+} batch = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void object_batch_begin(void)
+{
+	/* a single object has nothing to share a flush with */
+	if (object_fsync_policy() == OBJECT_FSYNC_BATCH)
+		batch.active = 1;
+}
+
+static int object_batch_add(const char *path, const char *filename,
+		char **error)
+{
+	struct object_batch_entry *entry;
+
+	pthread_mutex_lock(&batch.lock);
+	if (batch.entries_count == batch.allocated) {
+		void *ptr;
+		size_t allocated;
+
+		allocated = batch.allocated ? batch.allocated * 2 : 256;
+		ptr = realloc(batch.entries, allocated * sizeof(*batch.entries));
+		if (!ptr) {
+			pthread_mutex_unlock(&batch.lock);
+			asprintf(error, "realloc fail: %m");
+			return -1;
+		}
+		batch.entries = ptr;
+		batch.allocated = allocated;
+	}
+	entry = &batch.entries[batch.entries_count++];
+	entry->path = strdup(path);
+	entry->filename = strdup(filename);
+	pthread_mutex_unlock(&batch.lock);
+
+	return 0;
+}
+
+/* Flush the file system holding the objects. syncfs(2) does it in one call,
+ * otherwise every pending file is flushed on its own. */
+static int objects_sync(int fd, char **error)
+{
+	size_t i;
+
+	if (syncfs(fd) == 0)
+		return 0;
+
+	for (i = 0; i < batch.entries_count; i++) {
+		int file = open(batch.entries[i].path, O_RDONLY);
+
+		if (file < 0 || fdatasync(file) < 0) {
+			asprintf(error, "fdatasync '%s' fail: %m", batch.entries[i].path);
+			if (file >= 0)
+				close(file);
+			return -1;
+		}
+		close(file);
+	}
+
+	return 0;
+}
+
+int object_batch_end(char **error)
+{
+	char *directory;
+	char objects[PATH_MAX];
+	int fd;
+	int result;
+	size_t i;
+
+	if (!batch.active)
+		return 0;
+	batch.active = 0;
+	if (batch.entries_count == 0)
+		return 0;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(objects, sizeof(objects), "%s/objects", directory);
+
+	result = 0;
+	fd = open(objects, O_RDONLY|O_DIRECTORY);
+	if (fd < 0) {
+		asprintf(error, "open '%s' fail: %m", objects);
+		result = -1;
+	} else if (objects_sync(fd, error) < 0) {
+		result = -1;
+	}
+
+	for (i = 0; i < batch.entries_count; i++) {
+		struct object_batch_entry *entry = &batch.entries[i];
+
+		if (result < 0)
+			unlink(entry->path);
+		else if (object_rename(entry->path, entry->filename, 0, error) < 0)
+			result = -1;
+		free(entry->path);
+		free(entry->filename);
+	}
+	free(batch.entries);
+	batch.entries = NULL;
+	batch.entries_count = batch.allocated = 0;
+
+	/* and once more for the new names */
+	if (result == 0 && syncfs(fd) < 0 && fsync(fd) < 0) {
+		asprintf(error, "fsync '%s' fail: %m", objects);
+		result = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return result;
+}
+
+static int object_writer_finish(struct object_writer *writer, uint8_t *sha1,
+		char **error)
+{
+	char filename[PATH_MAX];
+	int policy;
+
+	if (object_writer_compress(writer, NULL, 0, 1, error) < 0) {
+		object_writer_abort(writer);
+		return -1;
+	}
+	codec_compress_end(&writer->stream);
+	free(writer->chunk);
+	SHA1_Final(sha1, &writer->ctx);
+
+	if (writer->fd < 0)
+		return 0;
+
+	policy = object_fsync_policy();
+	fchmod(writer->fd, 0444);
+	if (policy != OBJECT_FSYNC_NONE && !batch.active &&
+			fdatasync(writer->fd) < 0) {
+		asprintf(error, "fdatasync '%s' fail: %m", writer->path);
+		close(writer->fd);
+		unlink(writer->path);
+		return -1;
+	}
+	close(writer->fd);
+
+	sha1_filename_r(sha1, filename);
+	if (batch.active)
+		return object_batch_add(writer->path, filename, error);
+
+	return object_rename(writer->path, filename, policy != OBJECT_FSYNC_NONE,
+			error);
+}
+
+/* Hash an object given as a header and a payload, and store it unless it is
+ * already in the database. With format 2 the sha1 is known before anything
+ * gets compressed, so objects already stored only cost a hash and a stat. */
+static int object_parts_sha1(const void *header, size_t header_bytes,
+		const void *payload, size_t payload_bytes,
+		int write, uint8_t *sha1,
+		char **error)
+{
+	struct object_writer writer;
+
+	if (object_format() != 1) {
+		SHA_CTX ctx;
+
+		SHA1_Init(&ctx);
+		SHA1_Update(&ctx, header, header_bytes);
+		SHA1_Update(&ctx, payload, payload_bytes);
+		SHA1_Final(sha1, &ctx);
+
+		if (!write || object_exists(sha1))
+			return 0;
+	}
+
+	if (object_writer_init(&writer, write, error) < 0)
+		return -1;
+	if (object_writer_update(&writer, header, header_bytes, error) < 0)
+		return -1;
+	if (object_writer_update(&writer, payload, payload_bytes, error) < 0)
+		return -1;
+
+	return object_writer_finish(&writer, sha1, error);
+}
+
+int buffer_sha1(uint8_t *buffer, size_t bytes,
+		int write, uint8_t *sha1,
+		char **error)
+{
+	return object_parts_sha1(buffer, bytes, NULL, 0, write, sha1, error);
+}
+
+int file_sha1_write(uint8_t *buffer, size_t bytes, uint8_t *sha1, char **error)
+{
+	return buffer_sha1(buffer, bytes, 1, sha1, error);
+}
+
+/* "type size\0" prefix of every object, returns its length (NUL included) */
+static int object_header(char *header, size_t header_bytes,
+		const char *type, size_t bytes)
+{
+	return snprintf(header, header_bytes, "%s %zu", type, bytes) + 1;
+}
+
+int object_hash(uint8_t *buffer, size_t bytes, char *type,
+		int write, uint8_t *sha1,
+		char **error)
+{
+	char header[64];
+	int header_bytes;
+
+	header_bytes = object_header(header, sizeof(header), type, bytes);
+
+	return object_parts_sha1(header, header_bytes, buffer, bytes,
+			write, sha1, error);
+}
+
+/* Feed 'bytes' bytes of fd, chunk by chunk, to a sha1 context and/or an
+ * object writer. Fails if the file does not have the expected size. */
+static int fd_chunks(int fd, size_t bytes, uint8_t *chunk,
+		SHA_CTX *ctx, struct object_writer *writer,
+		char **error)
+{
+	size_t rd;
+	ssize_t n;
+
+	rd = 0;
+	for (;;) {
+		n = read(fd, chunk, OBJECT_CHUNK_BYTES);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
+				continue;
+			asprintf(error, "read %d fail: %m", fd);
+			return -1;
+		}
+		rd += n;
+		if (rd > bytes)
+			break;
+		if (ctx)
+			SHA1_Update(ctx, chunk, n);
+		if (writer && object_writer_compress(writer, chunk, n, 0, error) < 0)
+			return -1;
+	}
+
+	/* the header has already been hashed with the size given by fstat(2) */
+	if (rd != bytes) {
+		asprintf(error, "file size changed while reading (%zu != %zu)",
+				rd, bytes);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Hash 'bytes' bytes read from fd as an object of the given type. The file
+ * goes through a fixed size chunk, it is never loaded in memory as a whole.
+ * With format 2 the file is hashed first and only read a second time to be
+ * compressed if the object is not already stored. */
+static int fd_hash_stream(int fd, size_t bytes, const char *type,
+		int write, uint8_t *sha1,
+		char **error)
+{
+	struct object_writer writer;
+	char header[64];
+	int header_bytes;
+	uint8_t *chunk;
+	uint8_t written_sha1[20];
+
+	chunk = malloc(OBJECT_CHUNK_BYTES);
+	if (!chunk) {
+		asprintf(error, "malloc fail: %m");
+		return -1;
+	}
+
+	header_bytes = object_header(header, sizeof(header), type, bytes);
+	if (object_format() != 1) {
+		SHA_CTX ctx;
+
+		SHA1_Init(&ctx);
+		SHA1_Update(&ctx, header, header_bytes);
+		if (fd_chunks(fd, bytes, chunk, &ctx, NULL, error) < 0) {
+			free(chunk);
+			return -1;
+		}
+		SHA1_Final(sha1, &ctx);
+
+		if (!write || object_exists(sha1)) {
+			free(chunk);
+			return 0;
+		}
+
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			asprintf(error, "lseek %d fail: %m", fd);
+			free(chunk);
+			return -1;
+		}
+	}
+
+	if (object_writer_init(&writer, write, error) < 0) {
+		free(chunk);
+		return -1;
+	}
+	if (object_writer_update(&writer, header, header_bytes, error) < 0) {
+		free(chunk);
+		return -1;
+	}
+	if (fd_chunks(fd, bytes, chunk, writer.hash_compressed ? NULL : &writer.ctx,
+				&writer, error) < 0) {
+		object_writer_abort(&writer);
+		free(chunk);
+		return -1;
+	}
+	free(chunk);
+
+	if (object_writer_finish(&writer, written_sha1, error) < 0)
+		return -1;
+
+	if (!writer.hash_compressed && memcmp(sha1, written_sha1, 20)) {
+		char hex[41];
+
+		asprintf(error, "file changed while being stored as '%s'",
+				sha12hex_r(written_sha1, hex));
+		return -1;
+	}
+	memcpy(sha1, written_sha1, 20);
+
+	return 0;
+}
+
+int fd_hash(int fd,
+		int write, uint8_t *sha1,
+		char **error)
+{
+	uint8_t *buffer;
+	size_t bytes;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		asprintf(error, "fstat %d fail: %m", fd);
+		return -1;
+	}
+
+	if (S_ISREG(st.st_mode))
+		return fd_hash_stream(fd, st.st_size, "blob", write, sha1, error);
+
+	/* pipes and the like: the size is only known once everything is read */
+	if (fd_read(fd, &buffer, &bytes, error) < 0)
+		return -1;
+
+	if (object_hash(buffer, bytes, "blob", write, sha1, error) < 0) {
+		free(buffer);
+		return -1;
+	}
+
+	free(buffer);
+
+	return 0;
+}
+
+/* Version 1 entries are struct index_entry as is, they are used in place */
+static int index_entries_v1(struct index *index, uint8_t **data, uint8_t *end)
+{
+	uint8_t *offset = *data;
+	int i;
+
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = (struct index_entry *) offset;
+
+		if (end - offset < sizeof(*entry) ||
+				end - offset < sizeof(*entry) + entry->name_bytes) {
+			index->entries_count = i;
+			return -1;
+		}
+		index->entries[i] = entry;
+		offset += sizeof(*entry) + entry->name_bytes;
+	}
+	*data = offset;
+
+	return 0;
+}
+
+/* Version 2 entries are the stat data and sha1, then the number of bytes to
+ * strip from the end of the previous name (varint) and the NUL terminated
+ * suffix to append to it. They are rebuilt in a single allocation. */
+#define INDEX_ENTRY_V2_BYTES	offsetof(struct index_entry, name_bytes)
+
+static int index_entry_v2_parse(uint8_t *offset, uint8_t *end,
+		size_t previous_bytes, size_t *strip, uint8_t **suffix,
+		size_t *suffix_bytes)
+{
+	uint64_t value;
+	uint8_t *nul;
+	int n;
+
+	if (end - offset < INDEX_ENTRY_V2_BYTES)
+		return -1;
+	offset += INDEX_ENTRY_V2_BYTES;
+	n = varint_decode(offset, end - offset, &value);
+	if (n < 0 || value > previous_bytes)
+		return -1;
+	*strip = value;
+	*suffix = offset + n;
+	nul = memchr(*suffix, '\0', end - *suffix);
+	if (!nul || previous_bytes - value + (nul - *suffix) > UINT16_MAX)
+		return -1;
+	*suffix_bytes = nul - *suffix;
+
+	return INDEX_ENTRY_V2_BYTES + n + *suffix_bytes + 1;
+}
+
+static int index_entries_v2(struct index *index, uint8_t **data, uint8_t *end)
+{
+	uint8_t *offset, *suffix, *p;
+	size_t strip, suffix_bytes, name_bytes, arena_bytes;
+	int i, n;
+
+	/* sizes first */
+	offset = *data;
+	name_bytes = arena_bytes = 0;
+	for (i = 0; i < index->entries_count; i++) {
+		n = index_entry_v2_parse(offset, end, name_bytes, &strip, &suffix,
+				&suffix_bytes);
+		/* none was read yet, index_free() must not free any */
+		if (n < 0) {
+			index->entries_count = 0;
+			return -1;
+		}
+		name_bytes = name_bytes - strip + suffix_bytes;
+		arena_bytes += sizeof(struct index_entry) + name_bytes;
+		offset += n;
+	}
+
+	index->arena = malloc(arena_bytes ? arena_bytes : 1);
+	if (!index->arena) {
+		index->entries_count = 0;
+		return -1;
+	}
+	index->arena_bytes = arena_bytes;
+
+	offset = *data;
+	p = index->arena;
+	name_bytes = 0;
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = (struct index_entry *) p;
+
+		n = index_entry_v2_parse(offset, end, name_bytes, &strip, &suffix,
+				&suffix_bytes);
+		memcpy(entry, offset, INDEX_ENTRY_V2_BYTES);
+		/* prefix kept from the previous name */
+		if (i > 0)
+			memcpy(entry->name, index->entries[i - 1]->name,
+					name_bytes - strip);
+		memcpy(entry->name + name_bytes - strip, suffix, suffix_bytes);
+		name_bytes = name_bytes - strip + suffix_bytes;
+		entry->name_bytes = name_bytes;
+		index->entries[i] = entry;
+		offset += n;
+		p += sizeof(*entry) + name_bytes;
+	}
+	*data = offset;
+
+	return 0;
+}
+
+/* Entries are sorted by name, compared byte by byte, a name sorting before
+ * the longer names it is a prefix of */
+static int name_compare(const char *a, size_t a_bytes,
+		const char *b, size_t b_bytes)
+{
+	int result;
+
+	result = memcmp(a, b, a_bytes < b_bytes ? a_bytes : b_bytes);
+	if (result)
+		return result;
+	return a_bytes < b_bytes ? -1 : a_bytes > b_bytes;
+}
+
+/* A split index only holds the entries which differ from its shared index,
+ * named by the LINK extension: sha1 of the shared index, count of the shared
+ * entries deleted (32 bits), then their positions (32 bits each, sorted) */
+struct index_link {
+	uint8_t sha1[20];
+	uint32_t deleted_count;
+	const uint8_t *deleted;
+};
+
+/* Extensions of the index referring to the entries once merged with its
+ * shared index. The FSMN extension holds the last fsmonitor-daemon token,
+ * NUL, then the count of the entries not known clean at it (32 bits) and
+ * their positions (32 bits each, sorted). */
+struct index_extensions {
+	struct index_link link;
+	const uint8_t *monitor_dirty;
+	uint32_t monitor_dirty_count;
+};
+
+/* Extensions follow the entries: a signature, the size of the data (32 bits
+ * each) and the data. Unknown ones are skipped. */
+static int index_extensions_read(struct index *index, uint8_t *offset,
+		uint8_t *end, struct index_extensions *extensions)
+{
+	while (offset < end) {
+		uint32_t signature, bytes;
+
+		if (end - offset < 8)
+			return -1;
+		memcpy(&signature, offset, 4);
+		memcpy(&bytes, offset + 4, 4);
+		offset += 8;
+		if (bytes > end - offset)
+			return -1;
+		if (signature == TREE_CACHE_SIGNATURE) {
+			tree_cache_free(index->tree);
+			/* the cache is only an optimization */
+			index->tree = tree_cache_parse(offset, bytes);
+		} else if (signature == INDEX_LINK_SIGNATURE && extensions) {
+			struct index_link *link = &extensions->link;
+
+			if (bytes < 24)
+				return -1;
+			memcpy(link->sha1, offset, 20);
+			memcpy(&link->deleted_count, offset + 20, 4);
+			if (link->deleted_count > (bytes - 24) / 4)
+				return -1;
+			link->deleted = offset + 24;
+			index->split = 1;
+		} else if (signature == INDEX_MONITOR_SIGNATURE && extensions) {
+			uint8_t *nul = memchr(offset, '\0', bytes);
+			uint32_t count;
+
+			if (!nul || offset + bytes - (nul + 1) < 4)
+				return -1;
+			memcpy(&count, nul + 1, 4);
+			if (count > (offset + bytes - (nul + 5)) / 4)
+				return -1;
+			free(index->monitor_token);
+			index->monitor_token = strdup((char *) offset);
+			extensions->monitor_dirty = nul + 5;
+			extensions->monitor_dirty_count = count;
+		}
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+/* Read the index file filename into index. Returns 1 when there is no such
+ * file, leaving the index empty. */
+static int index_read(struct index *index, const char *filename,
+		int readonly, struct index_extensions *extensions, char **error)
+{
+	int fd;
+	size_t size;
+	struct index_header *header;
+	struct stat st;
+	void *map;
+	int result;
+	uint8_t *offset, *end;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		if (error)
+			asprintf(error, "open '%s': %m", filename);
+		return -1;
+	}
+
+	map = (void *) -1;
+	if (!fstat(fd, &st)) {
+		size = st.st_size;
+		index->mtime.seconds = st.st_mtim.tv_sec;
+		index->mtime.nanoseconds = st.st_mtim.tv_nsec;
+		if (size >= sizeof(struct index_header))
+			map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == (void *) -1) {
+		if (error)
+			asprintf(error, "%m");
+		return -1;
+	}
+
+	header = (struct index_header *) map;
+	if (!index_header_check(header))
+		goto corrupt;
+	switch (index_verify_mode()) {
+	case INDEX_VERIFY_FULL:
+		if (!index_checksum_check(header, size))
+			goto corrupt;
+		break;
+	case INDEX_VERIFY_LAZY:
+		/* only checked before it is replaced */
+		index->verify_pending = !readonly;
+		break;
+	}
+
+	index->version = header->version & GT_VERSION_MASK;
+	index->entries_count = header->entries_count;
+	index->entries = malloc(index->entries_count * sizeof(void *));
+	if (!index->entries && index->entries_count) {
+		if (error)
+			asprintf(error, "malloc: %m");
+		index->entries_count = 0;
+		munmap(map, size);
+		return -1;
+	}
+	/* version 1 entries stay in the mapping until they are modified */
+	index->map = map;
+	index->map_bytes = size;
+	offset = (uint8_t *) (header + 1);
+	end = (uint8_t *) map + size;
+	if (index->version == GT_VERSION)
+		result = index_entries_v1(index, &offset, end);
+	else
+		result = index_entries_v2(index, &offset, end);
+	if (result < 0 || index_extensions_read(index, offset, end, extensions) < 0)
+		goto corrupt;
+
+	return 0;
+
+corrupt:
+	if (error)
+		asprintf(error, "corrupt index '%s'", filename);
+	if (!index->map)
+		munmap(map, size);
+	return -1;
+}
+
+static void shared_index_path(struct index *index, uint8_t *sha1, char *path)
+{
+	char directory[PATH_MAX];
+	char hex[41];
+
+	strcpy(directory, index->path);
+	snprintf(path, PATH_MAX, "%s/sharedindex.%s", dirname(directory),
+			sha12hex_r(sha1, hex));
+}
+
+/* Merge the shared index of a split index with its own entries, which
+ * replace the shared entries of the same name. Returns 1 when the shared
+ * index does not exist. */
+static int index_base_load(struct index *index, struct index_link *link,
+		int readonly, char **error)
+{
+	char path[PATH_MAX];
+	struct index *base;
+	struct index_entry **entries;
+	uint32_t i, j, k, d, position;
+	int result;
+
+	shared_index_path(index, link->sha1, path);
+	base = calloc(1, sizeof(*base));
+	if (!base) {
+		if (error)
+			asprintf(error, "calloc: %m");
+		return -1;
+	}
+	base->path = strdup(path);
+	index->base = base;
+	memcpy(index->base_sha1, link->sha1, 20);
+	result = index_read(base, path, readonly, NULL, error);
+	if (result)
+		return result;
+
+	entries = malloc((base->entries_count + index->entries_count) *
+			sizeof(void *));
+	if (!entries && base->entries_count + index->entries_count) {
+		if (error)
+			asprintf(error, "malloc: %m");
+		return -1;
+	}
+	i = j = k = d = 0;
+	while (i < base->entries_count || j < index->entries_count) {
+		struct index_entry *a, *b;
+
+		if (i < base->entries_count && d < link->deleted_count) {
+			memcpy(&position, link->deleted + 4 * d, 4);
+			if (position <= i) {
+				d++;
+				i += position == i;
+				continue;
+			}
+		}
+		if (j == index->entries_count) {
+			entries[k++] = base->entries[i++];
+			continue;
+		}
+		if (i == base->entries_count) {
+			entries[k++] = index->entries[j++];
+			continue;
+		}
+		a = base->entries[i];
+		b = index->entries[j];
+		result = name_compare(a->name, a->name_bytes, b->name, b->name_bytes);
+		if (result < 0) {
+			entries[k++] = a;
+			i++;
+			continue;
+		}
+		entries[k++] = b;
+		i += result == 0;
+		j++;
+	}
+	free(index->entries);
+	index->entries = entries;
+	index->entries_count = k;
+
+	return 0;
+}
+
+/* The entries not known clean at the monitor token */
+static int index_monitor_read(struct index *index,
+		struct index_extensions *extensions, char **error)
+{
+	uint32_t i, position;
+
+	if (!index->monitor_token)
+		return 0;
+	index->monitor_dirty = malloc(extensions->monitor_dirty_count *
+			sizeof(void *));
+	if (!index->monitor_dirty && extensions->monitor_dirty_count) {
+		if (error)
+			asprintf(error, "malloc: %m");
+		return -1;
+	}
+	for (i = 0; i < extensions->monitor_dirty_count; i++) {
+		memcpy(&position, extensions->monitor_dirty + 4 * i, 4);
+		if (position >= index->entries_count) {
+			if (error)
+				asprintf(error, "corrupt index '%s'", index->path);
+			return -1;
+		}
+		index->monitor_dirty[index->monitor_dirty_count++] =
+			index->entries[position];
+	}
+
+	return 0;
+}
+
+/* The lock of the index being updated, removed at exit when a command
+ * returns without index_close() or index_free() */
+static char *lock_held;
+
+static void lock_release(void)
+{
+	if (lock_held)
+		unlink(lock_held);
+}
+
+/* Created exclusively so that two writers cannot interleave */
+static int lock_open(const char *path, char **error)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0664);
+	if (fd < 0 && error && errno == EEXIST)
+		asprintf(error, "'%s' exists: another process is updating the "
+				"index, or crashed (then remove it)", path);
+	else if (fd < 0 && error)
+		asprintf(error, "open '%s': %m", path);
+
+	return fd;
+}
+
+/* index.lock is taken for the whole update, so that a second writer fails up
+ * front instead of replacing the index with one which misses the updates of
+ * the first. The new index is written into it by index_close(). */
+static int index_lock(struct index *index, const char *filename,
+		char **error)
+{
+	static int registered;
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.lock", filename);
+	fd = lock_open(path, error);
+	if (fd < 0)
+		return -1;
+	index->lock_path = strdup(path);
+	if (!index->lock_path) {
+		if (error)
+			asprintf(error, "strdup: %m");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	index->lock_fd = fd;
+	if (!registered++)
+		atexit(lock_release);
+	lock_held = index->lock_path;
+
+	return 0;
+}
+
+/* Once renamed over the index the lock may belong to another process */
+static void index_lock_forget(struct index *index)
+{
+	if (lock_held == index->lock_path)
+		lock_held = NULL;
+	free(index->lock_path);
+	index->lock_path = NULL;
+	index->lock_fd = -1;
+}
+
+static void index_unlock(struct index *index)
+{
+	if (!index->lock_path)
+		return;
+	close(index->lock_fd);
+	unlink(index->lock_path);
+	index_lock_forget(index);
+}
+
+static struct index *index_load(int readonly, char **error)
+{
+	char filename[PATH_MAX];
+	struct index *index;
+	struct index_extensions extensions;
+	char *directory;
+	int retry = 1;
+	int result;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(filename, sizeof(filename), "%s/index", directory);
+
+again:
+	index = calloc(1, sizeof(*index));
+	if (!index) {
+		if (error)
+			asprintf(error, "calloc: %m");
+		return NULL;
+	}
+	/* for a new index */
+	index->version = config_get_int("index.version", "GT_INDEX_VERSION",
+			GT_VERSION);
+	if (index->version != GT_VERSION && index->version != GT_VERSION_2)
+		index->version = GT_VERSION;
+	index->path = strdup(filename);
+	/* before reading, so that no update is made in between */
+	if (!readonly && index_lock(index, filename, error) < 0)
+		goto fail;
+
+	memset(&extensions, 0, sizeof(extensions));
+	result = index_read(index, filename, readonly, &extensions, error);
+	if (result > 0)
+		return index;
+	if (result < 0)
+		goto fail;
+
+	if (index->split) {
+		result = index_base_load(index, &extensions.link, readonly, error);
+		if (result > 0 && retry--) {
+			/* folded into a new shared index since the index was read,
+			 * by a writer which held the lock */
+			index_free(index);
+			goto again;
+		}
+		if (result > 0 && error)
+			asprintf(error, "missing shared index '%s'", index->base->path);
+		if (result)
+			goto fail;
+	}
+	if (index_monitor_read(index, &extensions, error) < 0)
+		goto fail;
+
+	return index;
+
+fail:
+	index_free(index);
+	return NULL;
+}
+
+struct index *index_open(char **error)
+{
+	return index_load(0, error);
+}
+
+struct index *index_open_readonly(char **error)
+{
+	return index_load(1, error);
+}
+
+/* Entries in the mapping or rebuilt in the arena are not allocated alone */
+static int index_entry_mapped(struct index *index, struct index_entry *entry)
+{
+	uint8_t *p = (uint8_t *) entry;
+
+	if (index->map && p >= (uint8_t *) index->map &&
+			p < (uint8_t *) index->map + index->map_bytes)
+		return 1;
+	if (index->arena && p >= index->arena &&
+			p < index->arena + index->arena_bytes)
+		return 1;
+	return index->base && index_entry_mapped(index->base, entry);
+}
+
+/* A file modified in the same tick as the index was written, after its
+ * entry was made, still has the stat data of the entry: only its content
+ * tells whether it changed. Entries still from the shared index of a split
+ * index were written with it. */
+int index_entry_racy(struct index *index, struct index_entry *entry)
+{
+	struct time *mtime = &index->mtime;
+
+	if (index->base && index_entry_mapped(index->base, entry))
+		mtime = &index->base->mtime;
+	if (entry->mtime.seconds != mtime->seconds)
+		return entry->mtime.seconds > mtime->seconds;
+	return entry->mtime.nanoseconds >= mtime->nanoseconds;
+}
+
+static void index_entry_free(struct index *index, struct index_entry *entry)
+{
+	if (!index_entry_mapped(index, entry))
+		free(entry);
+}
+
+struct index_entry *index_entry_modify(struct index *index, int position,
+		char **error)
+{
+	struct index_entry *entry = index->entries[position];
+	struct index_entry *copy;
+	size_t entry_bytes;
+
+	if (!index_entry_mapped(index, entry))
+		return entry;
+
+	entry_bytes = sizeof(*entry) + entry->name_bytes;
+	copy = malloc(entry_bytes);
+	if (!copy) {
+		asprintf(error, "malloc fail: %m");
+		return NULL;
+	}
+	memcpy(copy, entry, entry_bytes);
+	index->entries[position] = copy;
+
+	return copy;
+}
+
+void index_free(struct index *index)
+{
+	int i;
+
+	for (i = 0; i < index->entries_count; i++)
+		index_entry_free(index, index->entries[i]);
+	if (index->base)
+		index_free(index->base);
+	if (index->monitor_changes)
+		monitor_changes_release(index->monitor_changes);
+	free(index->monitor_changes);
+	free(index->monitor_dirty);
+	free(index->monitor_clean);
+	free(index->monitor_smudged);
+	free(index->monitor_token);
+	index_unlock(index);
+	if (index->map)
+		munmap(index->map, index->map_bytes);
+	free(index->arena);
+	tree_cache_free(index->tree);
+	free(index->entries);
+	free(index->path);
+	free(index);
+}
+
+void index_monitor_begin(struct index *index)
+{
+	struct monitor_changes *changes;
+
+	changes = calloc(1, sizeof(*changes));
+	if (!changes || monitor_query(index->monitor_token, changes, NULL) < 0) {
+		/* without a daemon nothing is known clean */
+		free(changes);
+		free(index->monitor_token);
+		index->monitor_token = NULL;
+		return;
+	}
+	/* the entries of an index without token were never checked */
+	if (changes->everything || !index->monitor_token)
+		index->monitor_all_dirty = 1;
+	free(index->monitor_token);
+	index->monitor_token = strdup(changes->token);
+	index->monitor_changes = changes;
+}
+
+int index_monitor_dirty(struct index *index, struct index_entry *entry)
+{
+	uint32_t l, r, m;
+	int result;
+
+	l = 0;
+	r = index->monitor_dirty_count;
+	while (l < r) {
+		struct index_entry *dirty;
+
+		m = (l + r) / 2;
+		dirty = index->monitor_dirty[m];
+		result = name_compare(entry->name, entry->name_bytes,
+				dirty->name, dirty->name_bytes);
+		if (!result)
+			return 1;
+		if (result < 0)
+			r = m;
+		else
+			l = m + 1;
+	}
+
+	return 0;
+}
+
+/* Positions of the entries to save as not known clean at the token, NULL to
+ * drop the token. Since index_monitor_begin(), entries are dirty if the
+ * daemon reported them, unless they were added or refreshed since. Without
+ * it, they are those which already were. */
+static uint32_t *index_monitor_positions(struct index *index,
+		uint32_t *count)
+{
+	struct monitor_changes *changes = index->monitor_changes;
+	uint32_t *positions;
+	uint32_t i;
+
+	if (!index->monitor_token)
+		return NULL;
+	positions = malloc((index->entries_count + 1) * sizeof(uint32_t));
+	if (!positions)
+		return NULL;
+
+	*count = 0;
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = index->entries[i];
+		int dirty;
+
+		if (index->monitor_smudged && index->monitor_smudged[i])
+			dirty = 1;
+		else if (!changes)
+			dirty = index_monitor_dirty(index, entry);
+		else
+			dirty = index_entry_mapped(index, entry) &&
+				!(index->monitor_clean && index->monitor_clean[i]) &&
+				(index->monitor_all_dirty ||
+				 index_monitor_dirty(index, entry) ||
+				 monitor_changed(changes, entry->name, entry->name_bytes));
+		if (dirty)
+			positions[(*count)++] = i;
+	}
+	/* scanning would be about as cheap */
+	if (*count > index->entries_count / 2) {
+		free(positions);
+		return NULL;
+	}
+
+	return positions;
+}
+
+/* Serialize entries in a single buffer, with the extensions of the index
+ * when main, the link when given, and checksum it */
+static uint8_t *index_serialize(struct index *index,
+		struct index_entry **entries, uint32_t entries_count, int main,
+		struct index_link *link, uint32_t *deleted, size_t *bytes,
+		char **error)
+{
+	struct index_header *header;
+	struct tree_cache *tree = main ? index->tree : NULL;
+	uint8_t *buffer, *p;
+	size_t tree_bytes;
+	size_t token_bytes;
+	uint32_t *dirty = NULL;
+	uint32_t dirty_count = 0;
+	int i;
+	const char *checksum;
+
+	/* an upper bound for version 2, with the largest varints */
+	*bytes = sizeof(*header);
+	tree_bytes = 0;
+	for (i = 0; i < entries_count; i++)
+		*bytes += sizeof(struct index_entry) + entries[i]->name_bytes +
+			(index->version == GT_VERSION_2 ? 10 : 0);
+	if (tree) {
+		tree_bytes = tree_cache_bytes(tree);
+		*bytes += 8 + tree_bytes;
+	}
+	if (link)
+		*bytes += 8 + 24 + 4 * link->deleted_count;
+	if (main)
+		dirty = index_monitor_positions(index, &dirty_count);
+	if (dirty) {
+		token_bytes = strlen(index->monitor_token) + 1;
+		*bytes += 8 + token_bytes + 4 + 4 * dirty_count;
+	}
+	buffer = malloc(*bytes);
+	if (!buffer) {
+		if (error)
+			asprintf(error, "malloc fail: %m");
+		free(dirty);
+		return NULL;
+	}
+
+	header = (struct index_header *) buffer;
+	header->signature = GT_SIGNATURE;
+	header->version = index->version;
+	header->entries_count = entries_count;
+	p = buffer + sizeof(*header);
+	for (i = 0; i < entries_count; i++) {
+		struct index_entry *entry = entries[i];
+		struct index_entry *previous;
+		size_t common;
+
+		if (index->version != GT_VERSION_2) {
+			memcpy(p, entry, sizeof(*entry) + entry->name_bytes);
+			p += sizeof(*entry) + entry->name_bytes;
+			continue;
+		}
+
+		common = 0;
+		if (i > 0) {
+			previous = entries[i - 1];
+			while (common < previous->name_bytes &&
+					common < entry->name_bytes &&
+					previous->name[common] == entry->name[common])
+				common++;
+		}
+		memcpy(p, entry, INDEX_ENTRY_V2_BYTES);
+		p += INDEX_ENTRY_V2_BYTES;
+		p += varint_encode(p, i > 0 ? previous->name_bytes - common : 0);
+		memcpy(p, entry->name + common, entry->name_bytes - common);
+		p += entry->name_bytes - common;
+		*p++ = '\0';
+	}
+	if (tree) {
+		uint32_t extension[2] = { TREE_CACHE_SIGNATURE, tree_bytes };
+
+		memcpy(p, extension, sizeof(extension));
+		p = tree_cache_serialize(tree, p + sizeof(extension));
+	}
+	if (link) {
+		uint32_t extension[2] = { INDEX_LINK_SIGNATURE,
+			24 + 4 * link->deleted_count };
+
+		memcpy(p, extension, sizeof(extension));
+		memcpy(p + 8, link->sha1, 20);
+		memcpy(p + 28, &link->deleted_count, 4);
+		memcpy(p + 32, deleted, 4 * link->deleted_count);
+		p += 32 + 4 * link->deleted_count;
+	}
+	if (dirty) {
+		uint32_t extension[2] = { INDEX_MONITOR_SIGNATURE,
+			token_bytes + 4 + 4 * dirty_count };
+
+		memcpy(p, extension, sizeof(extension));
+		memcpy(p + 8, index->monitor_token, token_bytes);
+		p += 8 + token_bytes;
+		memcpy(p, &dirty_count, 4);
+		memcpy(p + 4, dirty, 4 * dirty_count);
+		p += 4 + 4 * dirty_count;
+		free(dirty);
+	}
+	*bytes = p - buffer;
+	checksum = config_get("index.checksum", "GT_INDEX_CHECKSUM");
+	if (checksum && !strcmp(checksum, "crc32c"))
+		header->version |= GT_INDEX_CRC32C;
+	index_checksum(header, *bytes, header->sha1);
+
+	return buffer;
+}
+
+/* Write to the lock file fd at path then rename it over filename: readers
+ * see either the old or the new file. The lock file is closed, and removed
+ * on failure. */
+static int lock_file_commit(int fd, const char *path, const char *filename,
+		uint8_t *buffer, size_t bytes, char **error)
+{
+	int sync;
+
+	sync = object_fsync_policy() != OBJECT_FSYNC_NONE;
+	if (exact_write(fd, buffer, bytes, error) < 0)
+		goto fail;
+	if (sync && fdatasync(fd) < 0) {
+		if (error)
+			asprintf(error, "fdatasync '%s' fail: %m", path);
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	if (rename(path, filename) < 0) {
+		if (error)
+			asprintf(error, "rename '%s' fail: %m", path);
+		goto fail;
+	}
+	if (sync) {
+		char directory[PATH_MAX];
+
+		strcpy(directory, filename);
+		fd = open(dirname(directory), O_RDONLY|O_DIRECTORY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	unlink(path);
+	return -1;
+}
+
+/* For the files other than the index, locked only while they are written */
+static int index_file_write(const char *filename, uint8_t *buffer,
+		size_t bytes, char **error)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.lock", filename);
+	fd = lock_open(path, error);
+	if (fd < 0)
+		return -1;
+
+	return lock_file_commit(fd, path, filename, buffer, bytes, error);
+}
+
+/* Replace the index with the lock taken by index_open() */
+static int index_lock_commit(struct index *index, uint8_t *buffer,
+		size_t bytes, char **error)
+{
+	int result;
+
+	if (!index->lock_path) {
+		if (error)
+			asprintf(error, "index '%s' opened read-only", index->path);
+		return -1;
+	}
+	result = lock_file_commit(index->lock_fd, index->lock_path, index->path,
+			buffer, bytes, error);
+	index_lock_forget(index);
+
+	return result;
+}
+
+/* Write only the entries which are not those of the shared index, and the
+ * positions of the shared entries deleted. Past index.splitthreshold percent
+ * of the shared entries, or to change its version, all of them are first
+ * written to a new shared index instead. */
+static int index_write_split(struct index *index, char **error)
+{
+	struct index *base = index->base;
+	struct index_entry **delta;
+	struct index_link link;
+	char path[PATH_MAX];
+	uint32_t *deleted;
+	uint32_t delta_count;
+	uint8_t *buffer;
+	size_t bytes;
+	uint32_t i, j;
+	int threshold;
+	int fold;
+	int result;
+
+	delta = malloc(index->entries_count * sizeof(void *));
+	deleted = malloc((base ? base->entries_count : 0) * sizeof(uint32_t));
+	if ((!delta && index->entries_count) ||
+			(!deleted && base && base->entries_count)) {
+		if (error)
+			asprintf(error, "malloc fail: %m");
+		free(delta);
+		free(deleted);
+		return -1;
+	}
+
+	delta_count = 0;
+	link.deleted_count = 0;
+	for (i = 0, j = 0; base && i < index->entries_count; i++) {
+		struct index_entry *entry = index->entries[i];
+		struct index_entry *shared = NULL;
+
+		for (; j < base->entries_count; j++) {
+			shared = base->entries[j];
+			if (name_compare(shared->name, shared->name_bytes,
+						entry->name, entry->name_bytes) >= 0)
+				break;
+			deleted[link.deleted_count++] = j;
+		}
+		if (j < base->entries_count && shared == entry) {
+			j++;
+			continue;
+		}
+		/* replaced */
+		if (j < base->entries_count && shared->name_bytes ==
+				entry->name_bytes && !memcmp(shared->name, entry->name,
+					entry->name_bytes))
+			j++;
+		delta[delta_count++] = entry;
+	}
+	for (; base && j < base->entries_count; j++)
+		deleted[link.deleted_count++] = j;
+
+	threshold = config_get_int("index.splitthreshold",
+			"GT_INDEX_SPLIT_THRESHOLD", INDEX_SPLIT_THRESHOLD);
+	fold = !base || base->version != index->version ||
+		(uint64_t) (delta_count + link.deleted_count) * 100 >
+		(uint64_t) threshold * base->entries_count;
+	if (fold) {
+		buffer = index_serialize(index, index->entries,
+				index->entries_count, 0, NULL, NULL, &bytes, error);
+		if (!buffer)
+			goto fail;
+		/* named after its content, the index which links it is the lock */
+		SHA1(buffer, bytes, link.sha1);
+		shared_index_path(index, link.sha1, path);
+		result = index_file_write(path, buffer, bytes, error);
+		free(buffer);
+		if (result < 0)
+			goto fail;
+		delta_count = 0;
+		link.deleted_count = 0;
+	} else {
+		memcpy(link.sha1, index->base_sha1, 20);
+	}
+
+	buffer = index_serialize(index, delta, delta_count, 1, &link, deleted,
+			&bytes, error);
+	if (!buffer)
+		goto fail;
+	result = index_lock_commit(index, buffer, bytes, error);
+	free(buffer);
+	if (result < 0)
+		goto fail;
+	if (fold && base && memcmp(link.sha1, index->base_sha1, 20))
+		unlink(base->path);
+
+	free(delta);
+	free(deleted);
+	return 0;
+
+fail:
+	free(delta);
+	free(deleted);
+	return -1;
+}
+
+/* Entries racily clean against the index being replaced would look clean
+ * against the new one, written later: their content is checked now and those
+ * which changed are smudged, their size set to 0 as git does, so that readers
+ * compare it. Entries added or refreshed by this process were just checked. */
+static int index_entries_smudge(struct index *index, char **error)
+{
+	uint32_t i;
+
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = index->entries[i];
+		char path[PATH_MAX];
+		uint8_t sha1[20];
+		struct stat st;
+		char *hash_error;
+		int changed;
+		int fd;
+
+		if (!entry->st_size || !index_entry_mapped(index, entry) ||
+				(index->monitor_clean && index->monitor_clean[i]) ||
+				!index_entry_racy(index, entry))
+			continue;
+
+		/* names are not NUL terminated in the index */
+		snprintf(path, sizeof(path), "%.*s", entry->name_bytes, entry->name);
+		changed = 1;
+		fd = open(path, O_RDONLY);
+		if (fd >= 0) {
+			if (!fstat(fd, &st) && st.st_size == entry->st_size) {
+				if (fd_hash_stream(fd, st.st_size, "blob", 0, sha1,
+							&hash_error) < 0)
+					free(hash_error);
+				else
+					changed = memcmp(sha1, entry->sha1, 20) != 0;
+			}
+			close(fd);
+		}
+		if (!changed)
+			continue;
+
+		entry = index_entry_modify(index, i, error);
+		if (!entry)
+			return -1;
+		entry->st_size = 0;
+		/* and not known clean by the monitor either */
+		if (!index->monitor_smudged)
+			index->monitor_smudged = calloc(index->entries_count, 1);
+		if (index->monitor_smudged) {
+			index->monitor_smudged[i] = 1;
+		} else {
+			free(index->monitor_token);
+			index->monitor_token = NULL;
+		}
+	}
+
+	return 0;
+}
+
+/* The new index is serialized in a single buffer and renamed over the index,
+ * see lock_file_commit(). With index.split, it is split in two files. */
+int index_close(struct index *index, char **error)
+{
+	uint8_t *buffer;
+	size_t bytes;
+	int result;
+
+	/* do not build on a corrupt index */
+	if ((index->verify_pending &&
+				!index_checksum_check(index->map, index->map_bytes)) ||
+			(index->base && index->base->verify_pending &&
+			 !index_checksum_check(index->base->map,
+				 index->base->map_bytes))) {
+		if (error)
+			asprintf(error, "corrupt index '%s', not replaced", index->path);
+		index_free(index);
+		return -1;
+	}
+
+	if (index_entries_smudge(index, error) < 0) {
+		index_free(index);
+		return -1;
+	}
+
+	if (config_get_int("index.split", "GT_INDEX_SPLIT", 0)) {
+		result = index_write_split(index, error);
+		index_free(index);
+		return result;
+	}
+
+	buffer = index_serialize(index, index->entries, index->entries_count,
+			1, NULL, NULL, &bytes, error);
+	if (!buffer) {
+		index_free(index);
+		return -1;
+	}
+	result = index_lock_commit(index, buffer, bytes, error);
+	free(buffer);
+	/* no longer split */
+	if (!result && index->base)
+		unlink(index->base->path);
+	index_free(index);
+
+	return result;
+}
+
+static int name_binary_search(struct index *index, char *name, size_t name_bytes)
+{
+	int l, r;
+
+	if (index->entries_count == 0)
+		return -0 - 1;
+
+	l = 0;
 	r = index->entries_count;
 	while (l < r) {
 		int result;
@@ -517,7 +2336,7 @@ static int name_binary_search(struct index *index, char *name, size_t name_bytes
 
 		m = (l + r) / 2;
 		e = index->entries[m];
-		result = strncmp(name, e->name, name_bytes);
+		result = name_compare(name, name_bytes, e->name, e->name_bytes);
 		if (!result)
 			return m;
 		if (result < 0) {
@@ -529,51 +2348,161 @@ static int name_binary_search(struct index *index, char *name, size_t name_bytes
 	return -l - 1;
 }
 
-int index_file_add(struct index *index, const char *filename,
-		uint8_t *sha1, char **error)
+int stat_changed(struct index_entry *entry, struct stat *st)
+{
+	int changes = 0;
+
+	if (entry->ctime.seconds != st->st_ctim.tv_sec ||
+			entry->ctime.nanoseconds != st->st_ctim.tv_nsec)
+		changes |= CTIME_CHANGED;
+	if (entry->mtime.seconds != st->st_mtim.tv_sec ||
+			entry->mtime.nanoseconds != st->st_mtim.tv_nsec)
+		changes |= MTIME_CHANGED;
+	if (entry->st_dev != st->st_dev ||
+			entry->st_ino != st->st_ino)
+		changes |= INODE_CHANGED;
+	if (entry->st_mode != st->st_mode)
+		changes |= MODE_CHANGED;
+	if (entry->st_uid != st->st_uid ||
+			entry->st_gid != st->st_gid)
+		changes |= OWNER_CHANGED;
+	if (entry->st_size != st->st_size || !entry->st_size)
+		changes |= SIZE_CHANGED;
+
+	return changes;
+}
+
+static void entry_stat_set(struct index_entry *entry, struct stat *st)
+{
+	entry->st_dev = st->st_dev;
+	entry->st_ino = st->st_ino;
+	entry->st_mode = st->st_mode;
+	entry->st_uid = st->st_uid;
+	entry->st_gid = st->st_gid;
+	entry->st_size = st->st_size;
+	entry->mtime.seconds = st->st_mtim.tv_sec;
+	entry->mtime.nanoseconds = st->st_mtim.tv_nsec;
+	entry->ctime.seconds = st->st_ctim.tv_sec;
+	entry->ctime.nanoseconds = st->st_ctim.tv_nsec;
+}
+
+int index_entry_refresh(struct index *index, int position, char **error)
+{
+	struct index_entry *entry = index->entries[position];
+	char path[PATH_MAX];
+	uint8_t sha1[20];
+	struct stat st;
+	int changes;
+	int fd;
+
+	/* the daemon saw no change since it was */
+	if (index->monitor_changes && !index->monitor_all_dirty &&
+			index_entry_mapped(index, entry) &&
+			!index_monitor_dirty(index, entry) &&
+			!monitor_changed(index->monitor_changes, entry->name,
+				entry->name_bytes))
+		return 0;
+
+	/* names are not NUL terminated in the index */
+	snprintf(path, sizeof(path), "%.*s", entry->name_bytes, entry->name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		asprintf(error, "open '%s' fail: %m", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		asprintf(error, "fstat '%s' fail: %m", path);
+		close(fd);
+		return -1;
+	}
+
+	changes = stat_changed(entry, &st);
+	if (!changes && !index_entry_racy(index, entry))
+		goto clean;
+	if ((changes & MODE_CHANGED) ||
+			((changes & SIZE_CHANGED) && entry->st_size)) {
+		close(fd);
+		return 1;
+	}
+	if (fd_hash_stream(fd, st.st_size, "blob", 0, sha1, error) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (memcmp(sha1, entry->sha1, sizeof(sha1))) {
+		close(fd);
+		return 1;
+	}
+	if (changes) {
+		entry = index_entry_modify(index, position, error);
+		if (!entry) {
+			close(fd);
+			return -1;
+		}
+		entry_stat_set(entry, &st);
+	}
+
+clean:
+	close(fd);
+	if (!index->monitor_clean)
+		index->monitor_clean = calloc(index->entries_count, 1);
+	if (index->monitor_clean)
+		index->monitor_clean[position] = 1;
+
+	return 0;
+}
+
+struct index_entry *index_entry_create(const char *filename, char **error)
 {
 	struct index_entry *entry;
 	int fd;
 	struct stat st;
-	int position;
-	
+	uint8_t sha1[20];
+
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
 		asprintf(error, "open '%s' fail: %m", filename);
-		return -1;
+		return NULL;
 	}
 	if (fstat(fd, &st) < 0) {
 		asprintf(error, "fstat '%s' fail: %m", filename);
 		close(fd);
-		return -1;
+		return NULL;
 	}
 
-	if (fd_hash(fd, 1, sha1, error) < 0) {
+	if (fd_hash_stream(fd, st.st_size, "blob", 1, sha1, error) < 0) {
 		close(fd);
-		return -1;
+		return NULL;
 	}
+	close(fd);
 
 	entry = calloc(1, sizeof(*entry) + strlen(filename));
 	if (!entry) {
-		close(fd);
-		return -1;
+		asprintf(error, "calloc fail: %m");
+		return NULL;
 	}
-	entry->st_dev = st.st_dev;
-	entry->st_ino = st.st_ino;
-	entry->st_mode = st.st_mode;
-	entry->st_uid = st.st_uid;
-	entry->st_gid = st.st_gid;
-	entry->st_size = st.st_size;
-	entry->mtime.seconds = st.st_mtim.tv_sec;
-	entry->ctime.seconds = st.st_ctim.tv_sec;
+	entry_stat_set(entry, &st);
 	memcpy(entry->sha1, sha1, sizeof(entry->sha1));
 	entry->name_bytes = strlen(filename);
 	memcpy(entry->name, filename, strlen(filename));
 
+	return entry;
+}
+
+int index_entry_add(struct index *index, struct index_entry *entry,
+		char **error)
+{
+	int position;
+
+	tree_cache_invalidate(index->tree, entry->name, entry->name_bytes);
+	/* positions move */
+	free(index->monitor_clean);
+	index->monitor_clean = NULL;
 	position = name_binary_search(index, entry->name, entry->name_bytes);
 	if (position >= 0) {
 		/* Already exist, update the entry */
-		free(index->entries[position]);
+		index_entry_free(index, index->entries[position]);
 		index->entries[position] = entry;
 	} else {
 		void *ptr;
@@ -594,7 +2523,110 @@ int index_file_add(struct index *index, const char *filename,
 		index->entries[position] = entry;
 	}
 
-	close(fd);
+	return 0;
+}
+
+struct batch_entry {
+	struct index_entry *entry;
+	size_t order;
+};
+
+static int batch_entry_compare(const void *a, const void *b)
+{
+	const struct batch_entry *ea = a, *eb = b;
+	int result;
+
+	result = name_compare(ea->entry->name, ea->entry->name_bytes,
+			eb->entry->name, eb->entry->name_bytes);
+	if (result)
+		return result;
+	return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+int index_add_batch(struct index *index, struct index_entry **entries,
+		size_t count, char **error)
+{
+	struct batch_entry *batch;
+	struct index_entry **merged;
+	size_t i, j, n;
+
+	batch = malloc(count * sizeof(*batch));
+	merged = malloc((index->entries_count + count) * sizeof(*merged));
+	if ((!batch || !merged) && count) {
+		asprintf(error, "malloc fail: %m");
+		free(batch);
+		free(merged);
+		for (i = 0; i < count; i++)
+			free(entries[i]);
+		return -1;
+	}
+
+	/* the order breaks ties: a path given twice gets its last entry */
+	for (i = 0; i < count; i++) {
+		batch[i].entry = entries[i];
+		batch[i].order = i;
+		tree_cache_invalidate(index->tree, entries[i]->name,
+				entries[i]->name_bytes);
+	}
+	qsort(batch, count, sizeof(*batch), batch_entry_compare);
+
+	i = j = n = 0;
+	while (i < index->entries_count || j < count) {
+		struct index_entry *old, *new;
+		int result;
+
+		if (j == count) {
+			merged[n++] = index->entries[i++];
+			continue;
+		}
+		new = batch[j].entry;
+		if (j + 1 < count && !name_compare(new->name, new->name_bytes,
+					batch[j + 1].entry->name, batch[j + 1].entry->name_bytes)) {
+			free(new);
+			j++;
+			continue;
+		}
+		if (i == index->entries_count) {
+			merged[n++] = new;
+			j++;
+			continue;
+		}
+
+		old = index->entries[i];
+		result = name_compare(old->name, old->name_bytes,
+				new->name, new->name_bytes);
+		if (result < 0) {
+			merged[n++] = old;
+			i++;
+			continue;
+		}
+		if (result == 0) {
+			index_entry_free(index, old);
+			i++;
+		}
+		merged[n++] = new;
+		j++;
+	}
+
+	free(batch);
+	free(index->entries);
+	free(index->monitor_clean);
+	index->monitor_clean = NULL;
+	index->entries = merged;
+	index->entries_count = n;
 
 	return 0;
 }
+
+int index_file_add(struct index *index, const char *filename,
+		uint8_t *sha1, char **error)
+{
+	struct index_entry *entry;
+
+	entry = index_entry_create(filename, error);
+	if (!entry)
+		return -1;
+	memcpy(sha1, entry->sha1, sizeof(entry->sha1));
+
+	return index_entry_add(index, entry, error);
+}
@@ -2,11 +2,60 @@
 #define INDEX_H
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "tree.h"
 
 #define GT_SIGNATURE	0x53494D50
 #define GT_VERSION		1
+/* Version 2 prefix compresses the names, see index_entries_v2(). Set with
+ * index.version (GT_INDEX_VERSION) for new indexes, or convert one with
+ * update-index --index-version */
+#define GT_VERSION_2	2
+
+/* The version word also carries flags. With GT_INDEX_CRC32C, selected by
+ * index.checksum = crc32c (GT_INDEX_CHECKSUM), the index is checked with a
+ * CRC-32C, stored in the first 4 bytes of the sha1 field, instead of a sha1 */
+#define GT_VERSION_MASK		0xffff
+#define GT_INDEX_CRC32C		0x10000
+
+/* When index_open() checks the checksum, index.verify (GT_INDEX_VERIFY):
+ * "full" on every open, "lazy" only before replacing the index, which skips
+ * it for read-only commands, or "none" */
+#define INDEX_VERIFY_FULL	0
+#define INDEX_VERIFY_LAZY	1
+#define INDEX_VERIFY_NONE	2
+
+/* With index.split (GT_INDEX_SPLIT), the index only holds the entries added,
+ * replaced or deleted since .gt/sharedindex.<sha1>, a full index which it
+ * links to and which is rewritten only once they are more than
+ * index.splitthreshold (GT_INDEX_SPLIT_THRESHOLD) percent of its entries */
+#define INDEX_LINK_SIGNATURE	0x4b4e494c	/* "LINK" */
+#define INDEX_SPLIT_THRESHOLD	20
+
+/* The last fsmonitor-daemon token and the entries not known clean at it, see
+ * monitor.h */
+#define INDEX_MONITOR_SIGNATURE	0x4e4d5346	/* "FSMN" */
 #define GT_DEFAULT_DIRECTORY "./.gt"
 
+/* Object ids are the sha1 of the uncompressed "type size\0payload" stream.
+ * Format 1 repositories named objects after their deflated stream, they can
+ * be converted with rehash-objects. Set with core.objectformat or
+ * GT_OBJECT_FORMAT */
+#define GT_OBJECT_FORMAT	2
+
+/* room needed to hold an object type, NUL included */
+#define OBJECT_TYPE_BYTES	32
+
+/* room enough for any "type size\0" object header */
+#define OBJECT_HEADER_BYTES	64
+
+/* size of the buffers objects are streamed through */
+#define OBJECT_CHUNK_BYTES	(64 * 1024)
+
 struct time {
 	uint32_t seconds;
 	uint32_t nanoseconds;
@@ -33,30 +82,189 @@ struct index_header {
 	uint8_t sha1[20];
 } __attribute__ ((packed));
 
+/* Entries point into the mapped index file as long as they are not modified:
+ * get a private copy with index_entry_modify() before writing to one. */
 struct index {
 	char *path;
+	/* index.lock, held by index_open() until the index is released */
+	char *lock_path;
+	int lock_fd;
 	uint32_t entries_count;
 	struct index_entry **entries; 
+	uint32_t version;
+	int verify_pending;
+	/* of the index file when it was read */
+	struct time mtime;
+	void *map;
+	size_t map_bytes;
+	uint8_t *arena;
+	size_t arena_bytes;
+	/* directories whose tree is known, see tree.h */
+	struct tree_cache *tree;
+	/* the shared index of a split index, whose entries are merged in */
+	int split;
+	struct index *base;
+	uint8_t base_sha1[20];
+	/* entries not known clean at the monitor token, see index_monitor_begin() */
+	char *monitor_token;
+	struct index_entry **monitor_dirty;
+	uint32_t monitor_dirty_count;
+	int monitor_all_dirty;
+	/* by position, entries index_entry_refresh() found clean */
+	uint8_t *monitor_clean;
+	/* by position, entries index_close() smudged */
+	uint8_t *monitor_smudged;
+	struct monitor_changes *monitor_changes;
 };
 
 /* NOTE: these two functions are not reentrant */
 char *sha12hex(uint8_t *sha1);
 char *sha1_filename(uint8_t *sha1);
 
+/* reentrant versions: sha1_ascii holds 41 bytes, filename PATH_MAX */
+char *sha12hex_r(uint8_t *sha1, char *sha1_ascii);
+char *sha1_filename_r(uint8_t *sha1, char *filename);
+
 int hex2sha1(const char *hex, uint8_t *sha1);
 
 int gt_directory_check(char **error);
 
+int exact_write(int fd,
+		const void *data, size_t bytes,
+		char **error);
+
 int object_hash(uint8_t *buffer, size_t bytes, char *type,
 		int write, uint8_t *sha1,
 		char **error);
 
+int fd_hash(int fd,
+		int write, uint8_t *sha1,
+		char **error);
+
+/* fails when another process holds index.lock */
 struct index *index_open(char **error);
+/* for commands which never write the index back, takes no lock */
+struct index *index_open_readonly(char **error);
+
+/* The entry is not older than the index: its stat data cannot prove the file
+ * unchanged */
+int index_entry_racy(struct index *index, struct index_entry *entry);
+/* Writers call it before adding entries, which are then known clean at a new
+ * token of fsmonitor-daemon, with the entries it reported changed since the
+ * previous one. Without a daemon the token is dropped. */
+void index_monitor_begin(struct index *index);
+/* The entry was not known clean at index->monitor_token */
+int index_monitor_dirty(struct index *index, struct index_entry *entry);
+
+/* What stat_changed() finds different between an entry and its file */
+#define CTIME_CHANGED	0x01
+#define MTIME_CHANGED	0x02
+#define INODE_CHANGED	0x04
+#define MODE_CHANGED	0x08
+#define OWNER_CHANGED	0x10
+#define SIZE_CHANGED	0x20
+
+/* An entry of size 0 may have been smudged by index_close(): it always has
+ * SIZE_CHANGED, which only proves a change when the entry has a size */
+int stat_changed(struct index_entry *entry, struct stat *st);
+
+/* Check the file of an entry: 0 when it matches the entry, whose stat data
+ * is updated when only the content was found the same (touch, chmod, copy),
+ * 1 when it changed or is missing. Call it after adding entries. */
+int index_entry_refresh(struct index *index, int position, char **error);
+
+/* index_close() writes the index back, both release it and its lock */
 int index_close(struct index *index, char **error);
+void index_free(struct index *index);
+struct index_entry *index_entry_modify(struct index *index, int position,
+		char **error);
 
 int index_file_add(struct index *index, const char *filename,
 		uint8_t *sha1, char **error);
 
+/* index_file_add() in two steps: hashing and storing the file, which can run
+ * concurrently, then the insertion in the index, which cannot. */
+struct index_entry *index_entry_create(const char *filename, char **error);
+int index_entry_add(struct index *index, struct index_entry *entry,
+		char **error);
+
+/* Insert (or replace) many entries at once: they are sorted then merged
+ * with the index in a single pass. The index takes the entries, they are
+ * freed on failure. */
+int index_add_batch(struct index *index, struct index_entry **entries,
+		size_t count, char **error);
+
+uint8_t *object_read(uint8_t *sha1, char *type, uint64_t *buffer_bytes,
+		char **error);
+int object_exists(uint8_t *sha1);
+
+/* Type and size of an object, only the header is inflated */
+int object_info(uint8_t *sha1, char *type, uint64_t *bytes, char **error);
+/* Parse a "type size\0" header, returns its length (NUL included) */
+int object_header_parse(const uint8_t *data, size_t bytes, char *type,
+		uint64_t *size);
+
+/* Calls fn for every loose object, stops when it returns non zero */
+int object_loose_for_each(
+		int (*fn)(uint8_t *sha1, void *data, char **error), void *data,
+		char **error);
+
+/* Reads many objects in a row: the decompression state and the output buffer
+ * are kept from one object to the next. The returned buffer belongs to the
+ * reader and is only valid until the next call. */
+struct object_reader {
+	struct codec_stream stream;
+	uint8_t *buffer;
+	size_t allocated;
+};
+
+void object_reader_init(struct object_reader *reader);
+uint8_t *object_reader_read(struct object_reader *reader, uint8_t *sha1,
+		char *type, uint64_t *buffer_bytes, char **error);
+void object_reader_release(struct object_reader *reader);
+
+/* Reads one object piece by piece, whatever its size: loose objects and
+ * objects stored in full in a pack are inflated straight into the caller's
+ * buffer. Objects stored as deltas are rebuilt in memory first. */
+struct object_stream {
+	char type[OBJECT_TYPE_BYTES];
+	uint64_t bytes;
+	uint64_t remaining;
+
+	struct codec_stream stream;
+	int ended;
+	uint8_t *map;
+	size_t map_bytes;
+	uint8_t *buffer;
+	/* header and first bytes of the payload */
+	uint8_t pending[OBJECT_HEADER_BYTES];
+	size_t pending_offset;
+	size_t pending_bytes;
+};
+
+int object_stream_open(struct object_stream *stream, uint8_t *sha1,
+		char **error);
+/* Returns the number of bytes read, 0 at the end of the object */
+ssize_t object_stream_read(struct object_stream *stream, void *buffer,
+		size_t bytes, char **error);
+void object_stream_close(struct object_stream *stream);
+
+void *file_sha1_map(uint8_t *sha1, size_t *map_bytes, char **error);
+uint8_t *file_sha1_inflate(void *map, size_t map_bytes,
+		char *type, uint64_t *buffer_bytes);
+
+/* core.fsync (GT_FSYNC) tells how objects are made durable: "none" leaves it
+ * to the system, "object" flushes every object on its own and "batch" (the
+ * default) flushes all the objects of an object_batch_begin()/end() at once,
+ * at the end. Objects only get their final name once flushed. */
+#define OBJECT_FSYNC_NONE	0
+#define OBJECT_FSYNC_BATCH	1
+#define OBJECT_FSYNC_OBJECT	2
+
+int object_fsync_policy(void);
+void object_batch_begin(void);
+int object_batch_end(char **error);
+
 uint8_t *file_sha1_read(uint8_t *sha1, uint64_t *buffer_bytes, char **error);
 int file_sha1_write(uint8_t *buffer, size_t bytes, uint8_t *sha1, char **error);
 
@@ -0,0 +1,609 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "linediff.h"
+
+/* files with a NUL in their first bytes are not diffed line by line */
+#define BINARY_CHECK_BYTES	8000
+
+/* edit cost past which Myers settles for the furthest reaching path */
+#define MYERS_MIN_COST		256
+
+struct line {
+	const uint8_t *data;
+	uint32_t bytes;
+	uint32_t hash;
+};
+
+struct lines {
+	uint32_t count;
+	struct line *lines;
+	/* class of each line, equal lines having the same */
+	uint32_t *classes;
+	uint8_t *changed;
+};
+
+struct linediff {
+	struct lines a;
+	struct lines b;
+	uint32_t classes_count;
+	/* furthest reaching x of each diagonal, forward and backward */
+	int *vf;
+	int *vb;
+	int max_cost;
+	/* per class, for patience */
+	uint32_t *count_a;
+	uint32_t *count_b;
+	uint32_t *position_b;
+};
+
+struct class {
+	const struct line *line;
+	uint32_t id;
+};
+
+static uint32_t lines_count(const uint8_t *data, size_t bytes)
+{
+	const uint8_t *p, *end, *eol;
+	uint32_t count;
+
+	count = 0;
+	end = data + bytes;
+	for (p = data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		count++;
+		if (!eol)
+			break;
+	}
+
+	return count;
+}
+
+static int lines_split(struct lines *lines, const uint8_t *data, size_t bytes)
+{
+	const uint8_t *p, *end, *eol;
+	uint32_t count;
+
+	end = data + bytes;
+	count = lines_count(data, bytes);
+	lines->count = count;
+	lines->lines = malloc((count + 1) * sizeof(*lines->lines));
+	lines->classes = malloc((count + 1) * sizeof(*lines->classes));
+	lines->changed = calloc(count + 1, 1);
+	if (!lines->lines || !lines->classes || !lines->changed)
+		return -1;
+
+	count = 0;
+	for (p = data; p < end; p = eol + 1) {
+		struct line *line = &lines->lines[count++];
+
+		eol = memchr(p, '\n', end - p);
+		/* the newline is part of the line, a last line without one
+		 * differs from the same line with it */
+		line->data = p;
+		line->bytes = (eol ? eol + 1 : end) - p;
+		line->hash = crc32c(0, line->data, line->bytes);
+		if (!eol)
+			break;
+	}
+
+	return 0;
+}
+
+static void lines_release(struct lines *lines)
+{
+	free(lines->lines);
+	free(lines->classes);
+	free(lines->changed);
+}
+
+static uint32_t class_find(struct class *table, size_t mask,
+		const struct line *line, uint32_t *classes_count)
+{
+	size_t i;
+
+	for (i = line->hash & mask; table[i].line; i = (i + 1) & mask) {
+		const struct line *other = table[i].line;
+
+		if (other->hash == line->hash && other->bytes == line->bytes &&
+				!memcmp(other->data, line->data, line->bytes))
+			return table[i].id;
+	}
+	table[i].line = line;
+	table[i].id = (*classes_count)++;
+
+	return table[i].id;
+}
+
+/* Number the lines of both files by content */
+static int lines_classify(struct linediff *diff)
+{
+	struct class *table;
+	size_t size, i;
+
+	size = 1024;
+	while (size < 2 * ((size_t) diff->a.count + diff->b.count))
+		size *= 2;
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < diff->a.count; i++)
+		diff->a.classes[i] = class_find(table, size - 1, &diff->a.lines[i],
+				&diff->classes_count);
+	for (i = 0; i < diff->b.count; i++)
+		diff->b.classes[i] = class_find(table, size - 1, &diff->b.lines[i],
+				&diff->classes_count);
+	free(table);
+
+	return 0;
+}
+
+/* Find a point of a shortest path from (a_lo, b_lo) to (a_hi, b_hi), whose
+ * first and last lines differ. Diagonals are numbered x - y. */
+static void myers_split(struct linediff *diff, int a_lo, int a_hi,
+		int b_lo, int b_hi, int *split_a, int *split_b)
+{
+	const uint32_t *A = diff->a.classes, *B = diff->b.classes;
+	int *vf = diff->vf, *vb = diff->vb;
+	int dmin = a_lo - b_hi, dmax = a_hi - b_lo;
+	int fmid = a_lo - b_lo, bmid = a_hi - b_hi;
+	int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+	int odd = (fmid - bmid) & 1;
+	int cost, d, x, y;
+
+	vf[fmid] = a_lo;
+	vb[bmid] = a_hi;
+	for (cost = 1;; cost++) {
+		if (fmin > dmin)
+			vf[--fmin - 1] = -1;
+		else
+			fmin++;
+		if (fmax < dmax)
+			vf[++fmax + 1] = -1;
+		else
+			fmax--;
+		for (d = fmax; d >= fmin; d -= 2) {
+			x = vf[d - 1] >= vf[d + 1] ? vf[d - 1] + 1 : vf[d + 1];
+			y = x - d;
+			while (x < a_hi && y < b_hi && A[x] == B[y]) {
+				x++;
+				y++;
+			}
+			vf[d] = x;
+			if (odd && bmin <= d && d <= bmax && vb[d] <= x) {
+				*split_a = x;
+				*split_b = y;
+				return;
+			}
+		}
+
+		if (bmin > dmin)
+			vb[--bmin - 1] = INT_MAX;
+		else
+			bmin++;
+		if (bmax < dmax)
+			vb[++bmax + 1] = INT_MAX;
+		else
+			bmax--;
+		for (d = bmax; d >= bmin; d -= 2) {
+			x = vb[d - 1] < vb[d + 1] ? vb[d - 1] : vb[d + 1] - 1;
+			y = x - d;
+			while (x > a_lo && y > b_lo && A[x - 1] == B[y - 1]) {
+				x--;
+				y--;
+			}
+			vb[d] = x;
+			if (!odd && fmin <= d && d <= fmax && x <= vf[d]) {
+				*split_a = x;
+				*split_b = y;
+				return;
+			}
+		}
+
+		if (cost < diff->max_cost)
+			continue;
+		/* too expensive: split where the forward search went furthest */
+		*split_a = -1;
+		for (d = fmax; d >= fmin; d -= 2) {
+			x = vf[d] < a_hi ? vf[d] : a_hi;
+			y = x - d;
+			if (y < b_lo || y > b_hi)
+				continue;
+			if (*split_a < 0 || x + y > *split_a + *split_b) {
+				*split_a = x;
+				*split_b = y;
+			}
+		}
+		if (*split_a >= 0)
+			return;
+	}
+}
+
+static void myers_compare(struct linediff *diff, int a_lo, int a_hi,
+		int b_lo, int b_hi)
+{
+	const uint32_t *A = diff->a.classes, *B = diff->b.classes;
+	int split_a, split_b;
+
+	while (a_lo < a_hi && b_lo < b_hi && A[a_lo] == B[b_lo]) {
+		a_lo++;
+		b_lo++;
+	}
+	while (a_lo < a_hi && b_lo < b_hi && A[a_hi - 1] == B[b_hi - 1]) {
+		a_hi--;
+		b_hi--;
+	}
+
+	if (a_lo == a_hi || b_lo == b_hi) {
+		memset(diff->a.changed + a_lo, 1, a_hi - a_lo);
+		memset(diff->b.changed + b_lo, 1, b_hi - b_lo);
+		return;
+	}
+
+	myers_split(diff, a_lo, a_hi, b_lo, b_hi, &split_a, &split_b);
+	if ((split_a == a_lo && split_b == b_lo) ||
+			(split_a == a_hi && split_b == b_hi)) {
+		/* no progress, should not happen */
+		memset(diff->a.changed + a_lo, 1, a_hi - a_lo);
+		memset(diff->b.changed + b_lo, 1, b_hi - b_lo);
+		return;
+	}
+	myers_compare(diff, a_lo, split_a, b_lo, split_b);
+	myers_compare(diff, split_a, a_hi, split_b, b_hi);
+}
+
+/* Longest increasing run of b positions among the unique lines, which are in
+ * a order: the anchors, returned in anchors_a and anchors_b */
+static int patience_anchors(uint32_t *unique_a, uint32_t *unique_b,
+		int count, uint32_t *anchors_a, uint32_t *anchors_b)
+{
+	int *tails, *previous;
+	int length, i, k;
+
+	tails = malloc(count * sizeof(int));
+	previous = malloc(count * sizeof(int));
+	if (!tails || !previous) {
+		free(tails);
+		free(previous);
+		return -1;
+	}
+
+	length = 0;
+	for (i = 0; i < count; i++) {
+		int l = 0, r = length;
+
+		while (l < r) {
+			int m = (l + r) / 2;
+
+			if (unique_b[tails[m]] < unique_b[i])
+				l = m + 1;
+			else
+				r = m;
+		}
+		previous[i] = l > 0 ? tails[l - 1] : -1;
+		tails[l] = i;
+		if (l == length)
+			length++;
+	}
+	/* the chain, in order; tails[k] >= k so the anchors may be written over
+	 * the unique lines */
+	for (k = length - 1, i = length ? tails[length - 1] : -1; i >= 0;
+			i = previous[i], k--)
+		tails[k] = i;
+	for (k = 0; k < length; k++) {
+		anchors_a[k] = unique_a[tails[k]];
+		anchors_b[k] = unique_b[tails[k]];
+	}
+
+	free(tails);
+	free(previous);
+
+	return length;
+}
+
+static int patience_compare(struct linediff *diff, int a_lo, int a_hi,
+		int b_lo, int b_hi)
+{
+	const uint32_t *A = diff->a.classes, *B = diff->b.classes;
+	uint32_t *unique_a, *unique_b;
+	int count, anchors, i;
+
+	while (a_lo < a_hi && b_lo < b_hi && A[a_lo] == B[b_lo]) {
+		a_lo++;
+		b_lo++;
+	}
+	while (a_lo < a_hi && b_lo < b_hi && A[a_hi - 1] == B[b_hi - 1]) {
+		a_hi--;
+		b_hi--;
+	}
+	if (a_lo == a_hi || b_lo == b_hi) {
+		myers_compare(diff, a_lo, a_hi, b_lo, b_hi);
+		return 0;
+	}
+
+	for (i = a_lo; i < a_hi; i++)
+		diff->count_a[A[i]]++;
+	for (i = b_lo; i < b_hi; i++) {
+		diff->count_b[B[i]]++;
+		diff->position_b[B[i]] = i;
+	}
+	unique_a = malloc(2 * (a_hi - a_lo) * sizeof(uint32_t));
+	if (!unique_a)
+		return -1;
+	unique_b = unique_a + (a_hi - a_lo);
+	count = 0;
+	for (i = a_lo; i < a_hi; i++) {
+		if (diff->count_a[A[i]] == 1 && diff->count_b[A[i]] == 1) {
+			unique_a[count] = i;
+			unique_b[count++] = diff->position_b[A[i]];
+		}
+	}
+	for (i = a_lo; i < a_hi; i++)
+		diff->count_a[A[i]] = 0;
+	for (i = b_lo; i < b_hi; i++)
+		diff->count_b[B[i]] = 0;
+
+	/* the anchors replace the unique lines in place */
+	anchors = count ? patience_anchors(unique_a, unique_b, count,
+			unique_a, unique_b) : 0;
+	if (anchors < 0) {
+		free(unique_a);
+		return -1;
+	}
+	if (!anchors) {
+		free(unique_a);
+		myers_compare(diff, a_lo, a_hi, b_lo, b_hi);
+		return 0;
+	}
+	for (i = 0; i < anchors; i++) {
+		if (patience_compare(diff, a_lo, unique_a[i], b_lo,
+					unique_b[i]) < 0) {
+			free(unique_a);
+			return -1;
+		}
+		a_lo = unique_a[i] + 1;
+		b_lo = unique_b[i] + 1;
+	}
+	free(unique_a);
+
+	return patience_compare(diff, a_lo, a_hi, b_lo, b_hi);
+}
+
+static int linediff_compare(struct linediff *diff, int algorithm)
+{
+	size_t diagonals;
+	int cost;
+
+	diagonals = (size_t) diff->a.count + diff->b.count + 3;
+	diff->vf = malloc(2 * diagonals * sizeof(int));
+	if (!diff->vf)
+		return -1;
+	/* indexed by diagonals, from -b.count - 1 */
+	diff->vb = diff->vf + diagonals;
+	diff->vf += diff->b.count + 1;
+	diff->vb += diff->b.count + 1;
+	for (cost = 1; cost * cost < diagonals; cost++)
+		;
+	diff->max_cost = cost > MYERS_MIN_COST ? cost : MYERS_MIN_COST;
+
+	if (algorithm == LINEDIFF_PATIENCE) {
+		diff->count_a = calloc(3 * (size_t) diff->classes_count + 1,
+				sizeof(uint32_t));
+		if (!diff->count_a)
+			return -1;
+		diff->count_b = diff->count_a + diff->classes_count;
+		diff->position_b = diff->count_b + diff->classes_count;
+		return patience_compare(diff, 0, diff->a.count, 0, diff->b.count);
+	}
+
+	myers_compare(diff, 0, diff->a.count, 0, diff->b.count);
+
+	return 0;
+}
+
+static void linediff_release(struct linediff *diff)
+{
+	if (diff->vf)
+		free(diff->vf - diff->b.count - 1);
+	free(diff->count_a);
+	lines_release(&diff->a);
+	lines_release(&diff->b);
+}
+
+/* "start,count" as diff -u does: the count is left out when 1, and an empty
+ * range starts at the line before it */
+static int range_print(struct buffer *out, uint32_t start, uint32_t count)
+{
+	if (count == 1)
+		return buffer_sprintf(out, "%u", start + 1);
+	return buffer_sprintf(out, "%u,%u", count ? start + 1 : start, count);
+}
+
+static int line_print(struct buffer *out, char prefix, struct line *line)
+{
+	static const char missing[] = "\n\\ No newline at end of file\n";
+
+	if (buffer_concat(out, &prefix, 1) < 0 ||
+			buffer_concat(out, (void *) line->data, line->bytes) < 0)
+		return -1;
+	if (line->data[line->bytes - 1] != '\n')
+		return buffer_concat(out, (void *) missing, sizeof(missing) - 1);
+
+	return 0;
+}
+
+/* Print the hunk made of the changes from (a, b) up to a_end, with their
+ * context */
+static int hunk_print(struct buffer *out, struct linediff *diff,
+		uint32_t a, uint32_t b, uint32_t a_end, uint32_t b_end)
+{
+	if (buffer_sprintf(out, "@@ -") < 0 || range_print(out, a, a_end - a) < 0 ||
+			buffer_sprintf(out, " +") < 0 ||
+			range_print(out, b, b_end - b) < 0 ||
+			buffer_sprintf(out, " @@\n") < 0)
+		return -1;
+
+	while (a < a_end || b < b_end) {
+		if (a < a_end && diff->a.changed[a]) {
+			if (line_print(out, '-', &diff->a.lines[a++]) < 0)
+				return -1;
+		} else if (b < b_end && diff->b.changed[b]) {
+			if (line_print(out, '+', &diff->b.lines[b++]) < 0)
+				return -1;
+		} else {
+			if (line_print(out, ' ', &diff->a.lines[a++]) < 0)
+				return -1;
+			b++;
+		}
+	}
+
+	return 0;
+}
+
+static int hunks_print(struct buffer *out, struct linediff *diff,
+		struct linediff_file *a, struct linediff_file *b)
+{
+	uint32_t i, j;
+	uint32_t hunk_a, hunk_b;
+	uint32_t end_a, end_b;
+	int header = 0;
+	int in_hunk = 0;
+
+	i = j = 0;
+	hunk_a = hunk_b = end_a = end_b = 0;
+	for (;;) {
+		uint32_t start_a, context;
+
+		/* skip the unchanged lines, which pair in order */
+		start_a = i;
+		while (i < diff->a.count && j < diff->b.count &&
+				!diff->a.changed[i] && !diff->b.changed[j]) {
+			i++;
+			j++;
+		}
+		if ((i == diff->a.count || !diff->a.changed[i]) &&
+				(j == diff->b.count || !diff->b.changed[j]))
+			break;
+		context = i - start_a;
+
+		if (in_hunk && context > 2 * LINEDIFF_CONTEXT) {
+			if (hunk_print(out, diff, hunk_a, hunk_b,
+						end_a + LINEDIFF_CONTEXT,
+						end_b + LINEDIFF_CONTEXT) < 0)
+				return -1;
+			in_hunk = 0;
+		}
+		if (!in_hunk) {
+			if (!header && (buffer_sprintf(out, "--- %s\n+++ %s\n",
+							a->label, b->label) < 0))
+				return -1;
+			header = 1;
+			start_a = i > LINEDIFF_CONTEXT ? i - LINEDIFF_CONTEXT : 0;
+			hunk_b = j - (i - start_a);
+			hunk_a = start_a;
+			in_hunk = 1;
+		}
+
+		while (i < diff->a.count && diff->a.changed[i])
+			i++;
+		while (j < diff->b.count && diff->b.changed[j])
+			j++;
+		end_a = i;
+		end_b = j;
+	}
+	if (!in_hunk)
+		return 0;
+
+	end_a = end_a + LINEDIFF_CONTEXT < diff->a.count ?
+		end_a + LINEDIFF_CONTEXT : diff->a.count;
+	end_b = end_b + LINEDIFF_CONTEXT < diff->b.count ?
+		end_b + LINEDIFF_CONTEXT : diff->b.count;
+
+	return hunk_print(out, diff, hunk_a, hunk_b, end_a, end_b);
+}
+
+static int binary(const uint8_t *data, size_t bytes)
+{
+	return memchr(data, '\0', bytes < BINARY_CHECK_BYTES ?
+			bytes : BINARY_CHECK_BYTES) != NULL;
+}
+
+/* Split, number and compare the lines of both files */
+static int linediff_prepare(struct linediff *diff, struct linediff_file *a,
+		struct linediff_file *b, int algorithm)
+{
+	int result;
+
+	memset(diff, 0, sizeof(*diff));
+	result = lines_split(&diff->a, a->data, a->bytes);
+	if (result == 0)
+		result = lines_split(&diff->b, b->data, b->bytes);
+	if (result == 0)
+		result = lines_classify(diff);
+	if (result == 0)
+		result = linediff_compare(diff, algorithm);
+
+	return result;
+}
+
+int linediff_unified(struct buffer *out, struct linediff_file *a,
+		struct linediff_file *b, int algorithm, char **error)
+{
+	struct linediff diff;
+	int result;
+
+	if (a->bytes == b->bytes && !memcmp(a->data, b->data, a->bytes))
+		return 0;
+	if (binary(a->data, a->bytes) || binary(b->data, b->bytes)) {
+		result = buffer_sprintf(out, "Binary files %s and %s differ\n",
+				a->label, b->label);
+		goto done;
+	}
+
+	result = linediff_prepare(&diff, a, b, algorithm);
+	if (result == 0)
+		result = hunks_print(out, &diff, a, b);
+	linediff_release(&diff);
+
+done:
+	if (result < 0 && error)
+		asprintf(error, "out of memory diffing '%s'", b->label);
+	return result;
+}
+
+int linediff_count(struct linediff_file *a, struct linediff_file *b,
+		int algorithm, uint32_t *added, uint32_t *deleted, char **error)
+{
+	struct linediff diff;
+	uint32_t i;
+
+	*added = *deleted = 0;
+	if (a->bytes == b->bytes && !memcmp(a->data, b->data, a->bytes))
+		return 0;
+	if (binary(a->data, a->bytes) || binary(b->data, b->bytes))
+		return 1;
+
+	/* a file added or deleted whole needs no comparison */
+	if (!a->bytes || !b->bytes) {
+		*deleted = lines_count(a->data, a->bytes);
+		*added = lines_count(b->data, b->bytes);
+		return 0;
+	}
+
+	if (linediff_prepare(&diff, a, b, algorithm) < 0) {
+		linediff_release(&diff);
+		if (error)
+			asprintf(error, "out of memory diffing '%s'", b->label);
+		return -1;
+	}
+	for (i = 0; i < diff.a.count; i++)
+		*deleted += diff.a.changed[i];
+	for (i = 0; i < diff.b.count; i++)
+		*added += diff.b.changed[i];
+	linediff_release(&diff);
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef LINEDIFF_H
+#define LINEDIFF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+
+/* Line diff of two buffers, in the unified format of diff -u.
+ *
+ * Lines are hashed once and numbered so that equal lines get the same class,
+ * the comparisons are then made on the classes. LINEDIFF_MYERS finds a
+ * minimal edit script (Myers' linear space algorithm, which falls back to an
+ * approximation when the script gets very long). LINEDIFF_PATIENCE first
+ * matches the lines found once in both files, in order, and runs Myers
+ * between them: moved blocks of code tend to read better. */
+
+#define LINEDIFF_MYERS		0
+#define LINEDIFF_PATIENCE	1
+
+/* lines of context around the changes */
+#define LINEDIFF_CONTEXT	3
+
+struct linediff_file {
+	const char *label;
+	const uint8_t *data;
+	size_t bytes;
+};
+
+/* Append the diff from a to b to out, nothing when they are equal */
+int linediff_unified(struct buffer *out, struct linediff_file *a,
+		struct linediff_file *b, int algorithm, char **error);
+
+/* Count the lines the diff from a to b would add and delete, without
+ * producing it. Returns 1 for binary files, which have no lines. */
+int linediff_count(struct linediff_file *a, struct linediff_file *b,
+		int algorithm, uint32_t *added, uint32_t *deleted, char **error);
+
+#endif /* LINEDIFF_H */
@@ -10,7 +10,7 @@ int main(int argc, char *argv[])
 	struct index *index;
 	char *error;
 
-	index = index_open(&error);
+	index = index_open_readonly(&error);
 	if (!index) {
 		fprintf(stderr, "%s\n", error);
 		free(error);
@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "index.h"
+#include "monitor.h"
+
+int monitor_socket_path(char *path, size_t bytes)
+{
+	char *directory;
+	int n;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	n = snprintf(path, bytes, "%s/%s", directory, MONITOR_SOCKET);
+
+	return n < bytes ? 0 : -1;
+}
+
+static int path_compare(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+static int monitor_connect(char **error)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (monitor_socket_path(address.sun_path, sizeof(address.sun_path)) < 0) {
+		if (error)
+			asprintf(error, "monitor socket path too long");
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		if (error)
+			asprintf(error, "socket fail: %m");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		if (error)
+			asprintf(error, "connect '%s' fail: %m", address.sun_path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Read the whole answer, giving up when the daemon is stuck */
+static int monitor_receive(int fd, char **data, size_t *bytes, char **error)
+{
+	struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+	size_t size = 4096;
+	char *ptr;
+	ssize_t n;
+
+	*bytes = 0;
+	*data = malloc(size);
+	if (!*data) {
+		if (error)
+			asprintf(error, "malloc fail: %m");
+		return -1;
+	}
+	for (;;) {
+		if (poll(&pollfd, 1, MONITOR_TIMEOUT_MS) <= 0) {
+			if (error)
+				asprintf(error, "no answer from the monitor");
+			goto fail;
+		}
+		n = read(fd, *data + *bytes, size - *bytes);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			if (error)
+				asprintf(error, "read fail: %m");
+			goto fail;
+		}
+		if (n == 0)
+			break;
+		*bytes += n;
+		if (*bytes == size) {
+			ptr = realloc(*data, size * 2);
+			if (!ptr) {
+				if (error)
+					asprintf(error, "realloc fail: %m");
+				goto fail;
+			}
+			*data = ptr;
+			size *= 2;
+		}
+	}
+
+	return 0;
+
+fail:
+	free(*data);
+	*data = NULL;
+	return -1;
+}
+
+int monitor_query(const char *token, struct monitor_changes *changes,
+		char **error)
+{
+	char *p, *end;
+	size_t bytes;
+	uint32_t count;
+	int fd;
+	int result;
+
+	memset(changes, 0, sizeof(*changes));
+	fd = monitor_connect(error);
+	if (fd < 0)
+		return -1;
+	result = exact_write(fd, token ? token : "", token ? strlen(token) : 0,
+			error);
+	if (result == 0)
+		result = exact_write(fd, "\n", 1, error);
+	if (result == 0)
+		result = monitor_receive(fd, &changes->data, &bytes, error);
+	close(fd);
+	if (result < 0)
+		return -1;
+
+	/* a token and a list of paths, all NUL terminated */
+	end = changes->data + bytes;
+	if (!bytes || end[-1] != '\0') {
+		if (error)
+			asprintf(error, "bad answer from the monitor");
+		monitor_changes_release(changes);
+		return -1;
+	}
+	count = 0;
+	for (p = changes->data; p < end; p += strlen(p) + 1)
+		count++;
+	changes->paths = malloc(count * sizeof(char *));
+	if (!changes->paths) {
+		if (error)
+			asprintf(error, "malloc fail: %m");
+		monitor_changes_release(changes);
+		return -1;
+	}
+	changes->token = changes->data;
+	for (p = changes->data + strlen(changes->data) + 1; p < end;
+			p += strlen(p) + 1) {
+		if (!strcmp(p, "/"))
+			changes->everything = 1;
+		else
+			changes->paths[changes->paths_count++] = p;
+	}
+	qsort(changes->paths, changes->paths_count, sizeof(char *), path_compare);
+
+	return 0;
+}
+
+void monitor_changes_release(struct monitor_changes *changes)
+{
+	free(changes->paths);
+	free(changes->data);
+	memset(changes, 0, sizeof(*changes));
+}
+
+static int monitor_listed(struct monitor_changes *changes,
+		const char *name, size_t name_bytes)
+{
+	uint32_t l, r, m;
+	int result;
+
+	l = 0;
+	r = changes->paths_count;
+	while (l < r) {
+		const char *path;
+
+		m = (l + r) / 2;
+		path = changes->paths[m];
+		result = strncmp(name, path, name_bytes);
+		if (!result)
+			result = path[name_bytes] ? -1 : 0;
+		if (!result)
+			return 1;
+		if (result < 0)
+			r = m;
+		else
+			l = m + 1;
+	}
+
+	return 0;
+}
+
+int monitor_changed(struct monitor_changes *changes,
+		const char *name, size_t name_bytes)
+{
+	size_t i;
+
+	if (changes->everything)
+		return 1;
+	if (monitor_listed(changes, name, name_bytes))
+		return 1;
+	for (i = 0; i < name_bytes; i++) {
+		if (name[i] == '/' && monitor_listed(changes, name, i))
+			return 1;
+	}
+
+	return 0;
+}
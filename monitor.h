@@ -0,0 +1,43 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* fsmonitor-daemon watches the working tree with inotify and tells which
+ * paths changed since a token it handed out earlier, so that diff only stats
+ * those. It listens on $GT_DIRECTORY/fsmonitor.sock:
+ *
+ *   request: the previous token, or nothing, then LF
+ *   answer:  a new token, NUL, then the changed paths relative to the working
+ *            tree, each followed by NUL, or "/" NUL when anything may have
+ *            changed (unknown token, events lost, daemon restarted)
+ *
+ * A directory in the answer stands for everything below it. */
+
+#define MONITOR_SOCKET			"fsmonitor.sock"
+#define MONITOR_COOKIE			"fsmonitor-cookie"
+/* how long a client waits for the daemon before scanning */
+#define MONITOR_TIMEOUT_MS		1000
+
+struct monitor_changes {
+	char *token;
+	int everything;
+	/* sorted */
+	char **paths;
+	uint32_t paths_count;
+	char *data;
+};
+
+int monitor_socket_path(char *path, size_t bytes);
+
+/* Fails when no daemon answers, changes is then empty */
+int monitor_query(const char *token, struct monitor_changes *changes,
+		char **error);
+void monitor_changes_release(struct monitor_changes *changes);
+
+/* Whether name, or a directory above it, changed */
+int monitor_changed(struct monitor_changes *changes,
+		const char *name, size_t name_bytes);
+
+#endif /* MONITOR_H */
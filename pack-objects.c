@@ -0,0 +1,117 @@
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "pack.h"
+
+struct objects {
+	uint8_t (*sha1s)[20];
+	size_t count;
+	size_t allocated;
+};
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
+{
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h] [--prune|-d]\n", program);
+
+	return return_value;
+}
+
+static int objects_add(uint8_t *sha1, void *data, char **error)
+{
+	struct objects *objects = data;
+
+	if (objects->count == objects->allocated) {
+		void *ptr;
+
+		objects->allocated = objects->allocated ? objects->allocated * 2 : 1024;
+		ptr = realloc(objects->sha1s, objects->allocated * 20);
+		if (!ptr) {
+			asprintf(error, "realloc fail: %m");
+			return -1;
+		}
+		objects->sha1s = ptr;
+	}
+	memcpy(objects->sha1s[objects->count++], sha1, 20);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int prune;
+	char *error;
+	struct objects objects;
+	uint8_t pack_sha1[20];
+
+	prune = 0;
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		if (!strncmp(arg, "--prune", sizeof("--prune")) ||
+				!strncmp(arg, "-d", sizeof("-d"))) {
+			prune = 1;
+			continue;
+		}
+
+		return usage(argv[0], 1, "Unknown option '%s'", arg);
+	}
+
+	if (!gt_directory_check(&error)) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
+
+	memset(&objects, 0, sizeof(objects));
+	if (object_loose_for_each(objects_add, &objects, &error) < 0)
+		goto fail;
+
+	if (objects.count == 0) {
+		fprintf(stderr, "nothing to pack\n");
+		return 0;
+	}
+
+	if (pack_write(objects.sha1s, objects.count, pack_sha1, &error) < 0)
+		goto fail;
+
+	fprintf(stdout, "%s\n", sha12hex(pack_sha1));
+
+	/* the pack is in place, the loose copies are now redundant */
+	if (prune) {
+		for (i = 0; i < objects.count; i++) {
+			char *filename = sha1_filename(objects.sha1s[i]);
+
+			if (unlink(filename) == 0)
+				rmdir(dirname(filename));
+		}
+	}
+
+	free(objects.sha1s);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "%s\n", error);
+	free(error);
+	free(objects.sha1s);
+	return 1;
+}
@@ -0,0 +1,1084 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "codec.h"
+#include "config.h"
+#include "delta.h"
+#include "index.h"
+#include "pack.h"
+
+#define PACK_OUTPUT_BYTES (1024 * 1024)
+
+#define PACK_WINDOW_DEFAULT		10
+#define PACK_BASE_CACHE_SLOTS	256
+#define PACK_BASE_CACHE_BYTES	(16 * 1024 * 1024)
+
+/* packs of the repository, loaded on first lookup */
+static struct pack *packs;
+static pthread_once_t packs_loaded = PTHREAD_ONCE_INIT;
+
+static void pack_directory(char *path, size_t bytes)
+{
+	char *directory;
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+	snprintf(path, bytes, "%s/objects/pack", directory);
+}
+
+static void *file_map(const char *filename, size_t *bytes)
+{
+	int fd;
+	void *map;
+	struct stat st;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == (void *) -1)
+		return NULL;
+	*bytes = st.st_size;
+
+	return map;
+}
+
+static struct pack *pack_load(const char *directory, const char *idx_name)
+{
+	char filename[PATH_MAX];
+	struct pack *pack;
+	struct pack_index_header *header;
+	struct pack_header *pack_header;
+	size_t length;
+
+	pack = calloc(1, sizeof(*pack));
+	if (!pack)
+		return NULL;
+
+	/* strip the ".idx" extension */
+	length = strlen(idx_name) - 4;
+	asprintf(&pack->path, "%s/%.*s", directory, (int) length, idx_name);
+
+	snprintf(filename, sizeof(filename), "%s.idx", pack->path);
+	pack->index = file_map(filename, &pack->index_bytes);
+	if (!pack->index)
+		goto fail;
+	if (pack->index_bytes < sizeof(*header) + 40)
+		goto fail;
+
+	header = (struct pack_index_header *) pack->index;
+	if (header->signature != PACK_INDEX_SIGNATURE ||
+			header->version != PACK_VERSION)
+		goto fail;
+	pack->fanout = (uint32_t *) (pack->index +
+			offsetof(struct pack_index_header, fanout));
+	pack->objects_count = pack->fanout[255];
+	if (pack->index_bytes != sizeof(*header) + pack->objects_count * 28 + 40)
+		goto fail;
+	pack->sha1s = (uint8_t *) (header + 1);
+	pack->offsets = (uint64_t *) (pack->sha1s + pack->objects_count * 20);
+
+	snprintf(filename, sizeof(filename), "%s.pack", pack->path);
+	pack->data = file_map(filename, &pack->data_bytes);
+	if (!pack->data)
+		goto fail;
+	pack_header = (struct pack_header *) pack->data;
+	if (pack->data_bytes < sizeof(*pack_header) + 20 ||
+			pack_header->signature != PACK_SIGNATURE ||
+			pack_header->version != PACK_VERSION ||
+			pack_header->objects_count != pack->objects_count)
+		goto fail;
+
+	return pack;
+
+fail:
+	fprintf(stderr, "warning: ignoring invalid pack '%s'\n", pack->path);
+	if (pack->index)
+		munmap(pack->index, pack->index_bytes);
+	if (pack->data)
+		munmap(pack->data, pack->data_bytes);
+	free(pack->path);
+	free(pack);
+	return NULL;
+}
+
+static void packs_read(void)
+{
+	char directory[PATH_MAX];
+	DIR *dir;
+	struct dirent *d;
+
+	pack_directory(directory, sizeof(directory));
+	dir = opendir(directory);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		struct pack *pack;
+		size_t length = strlen(d->d_name);
+
+		if (length < 4 || strcmp(d->d_name + length - 4, ".idx"))
+			continue;
+		pack = pack_load(directory, d->d_name);
+		if (!pack)
+			continue;
+		pack->next = packs;
+		packs = pack;
+	}
+	closedir(dir);
+}
+
+static void packs_load(void)
+{
+	pthread_once(&packs_loaded, packs_read);
+}
+
+static int pack_index_find(struct pack *pack, uint8_t *sha1, uint64_t *offset)
+{
+	uint32_t l, r;
+
+	l = sha1[0] ? pack->fanout[sha1[0] - 1] : 0;
+	r = pack->fanout[sha1[0]];
+	while (l < r) {
+		uint32_t m = l + (r - l) / 2;
+		int result;
+
+		result = memcmp(sha1, pack->sha1s + m * 20, 20);
+		if (!result) {
+			*offset = pack->offsets[m];
+			return 1;
+		}
+		if (result < 0)
+			r = m;
+		else
+			l = m + 1;
+	}
+
+	return 0;
+}
+
+int pack_find(uint8_t *sha1, struct pack **pack, uint64_t *offset)
+{
+	struct pack *p;
+
+	packs_load();
+	for (p = packs; p; p = p->next) {
+		if (pack_index_find(p, sha1, offset)) {
+			*pack = p;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Locate the data of the entry at offset, checking it fits in the pack */
+static int pack_entry(struct pack *pack, uint64_t offset,
+		int *kind, uint8_t **data, uint64_t *data_bytes)
+{
+	size_t end;
+	int header_bytes;
+
+	end = pack->data_bytes - 20;
+	if (offset < sizeof(struct pack_header) || offset >= end)
+		return -1;
+
+	*kind = pack->data[offset];
+	header_bytes = varint_decode(pack->data + offset + 1, end - offset - 1,
+			data_bytes);
+	if (header_bytes < 0)
+		return -1;
+	offset += 1 + header_bytes;
+	if (*data_bytes > end - offset)
+		return -1;
+	*data = pack->data + offset;
+
+	return 0;
+}
+
+/* Delta bases recently rebuilt, so that reading several objects deltified
+ * against the same chain does not rebuild it every time. Slots are picked by
+ * offset, the cache never holds more than PACK_BASE_CACHE_BYTES. It is shared
+ * by the threads under base_cache_lock, readers get a copy of the base. */
+struct base_cache_entry {
+	struct pack *pack;
+	uint64_t offset;
+	char type[OBJECT_TYPE_BYTES];
+	uint8_t *data;
+	uint64_t bytes;
+};
+
+static struct base_cache_entry base_cache[PACK_BASE_CACHE_SLOTS];
+static size_t base_cache_bytes;
+static pthread_mutex_t base_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct base_cache_entry *base_cache_slot(struct pack *pack,
+		uint64_t offset)
+{
+	return &base_cache[(offset ^ (uintptr_t) pack) % PACK_BASE_CACHE_SLOTS];
+}
+
+/* The type of the base at offset, and a copy of its data when data is not
+ * NULL. Returns 0 when it is not cached (or the copy failed). */
+static int base_cache_get(struct pack *pack, uint64_t offset, char *type,
+		uint8_t **data, uint64_t *bytes)
+{
+	struct base_cache_entry *entry = base_cache_slot(pack, offset);
+	int found = 0;
+
+	pthread_mutex_lock(&base_cache_lock);
+	if (entry->data && entry->pack == pack && entry->offset == offset) {
+		found = 1;
+		strcpy(type, entry->type);
+		if (data) {
+			*data = malloc(entry->bytes);
+			if (*data) {
+				memcpy(*data, entry->data, entry->bytes);
+				*bytes = entry->bytes;
+			} else {
+				found = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&base_cache_lock);
+
+	return found;
+}
+
+static void base_cache_evict(struct base_cache_entry *entry)
+{
+	base_cache_bytes -= entry->bytes;
+	free(entry->data);
+	entry->data = NULL;
+	entry->bytes = 0;
+}
+
+/* Takes ownership of data, returns 0 if it did not fit in the cache */
+static int base_cache_add(struct pack *pack, uint64_t offset,
+		const char *type, uint8_t *data, uint64_t bytes)
+{
+	struct base_cache_entry *entry;
+	static int next;
+	int i;
+
+	if (bytes > PACK_BASE_CACHE_BYTES / 4)
+		return 0;
+
+	pthread_mutex_lock(&base_cache_lock);
+	entry = base_cache_slot(pack, offset);
+	if (entry->data)
+		base_cache_evict(entry);
+	for (i = 0; base_cache_bytes + bytes > PACK_BASE_CACHE_BYTES &&
+			i < PACK_BASE_CACHE_SLOTS; i++) {
+		next = (next + 1) % PACK_BASE_CACHE_SLOTS;
+		if (base_cache[next].data)
+			base_cache_evict(&base_cache[next]);
+	}
+
+	entry->pack = pack;
+	entry->offset = offset;
+	strcpy(entry->type, type);
+	entry->data = data;
+	entry->bytes = bytes;
+	base_cache_bytes += bytes;
+	pthread_mutex_unlock(&base_cache_lock);
+
+	return 1;
+}
+
+/* Split the data of a PACK_DELTA entry */
+static int pack_delta_entry(uint8_t *data, uint64_t data_bytes,
+		uint64_t *base_offset, uint64_t *delta_bytes,
+		uint8_t **stream, uint64_t *stream_bytes)
+{
+	int n, m;
+
+	n = varint_decode(data, data_bytes, base_offset);
+	if (n < 0)
+		return -1;
+	m = varint_decode(data + n, data_bytes - n, delta_bytes);
+	if (m < 0)
+		return -1;
+	*stream = data + n + m;
+	*stream_bytes = data_bytes - n - m;
+
+	return 0;
+}
+
+static uint8_t *pack_delta_inflate(uint8_t *stream, uint64_t stream_bytes,
+		uint64_t delta_bytes)
+{
+	struct codec_stream codec;
+	uint8_t *delta;
+	int result;
+
+	delta = malloc(delta_bytes ? delta_bytes : 1);
+	if (!delta)
+		return NULL;
+	if (codec_decompress_init(&codec, stream, stream_bytes) < 0) {
+		free(delta);
+		return NULL;
+	}
+	codec.z.next_out = delta;
+	codec.z.avail_out = delta_bytes;
+	do {
+		result = codec_decompress(&codec);
+	} while (result == CODEC_OK && codec.z.avail_out > 0 &&
+			codec.z.avail_in > 0);
+	codec_decompress_end(&codec);
+
+	if (result < 0 || codec.z.avail_out > 0) {
+		free(delta);
+		return NULL;
+	}
+
+	return delta;
+}
+
+int pack_object_info(struct pack *pack, uint64_t offset,
+		char *type, uint64_t *bytes,
+		char **error)
+{
+	uint8_t head[OBJECT_HEADER_BYTES];
+	ssize_t head_bytes;
+	int depth;
+	int kind;
+	uint8_t *data;
+	uint64_t data_bytes;
+	uint64_t current;
+	uint64_t base_offset, delta_bytes, stream_bytes;
+	uint64_t base_bytes;
+	uint8_t *stream;
+	int n;
+
+	current = offset;
+	if (pack_entry(pack, current, &kind, &data, &data_bytes) < 0)
+		goto corrupt;
+	if (kind == PACK_OBJECT) {
+		head_bytes = codec_peek(data, data_bytes, head, sizeof(head));
+		if (head_bytes < 0 ||
+				object_header_parse(head, head_bytes, type, bytes) < 0)
+			goto corrupt;
+		return 0;
+	}
+
+	/* the size is in the delta header, the type is the one of the base */
+	if (kind != PACK_DELTA ||
+			pack_delta_entry(data, data_bytes, &base_offset, &delta_bytes,
+				&stream, &stream_bytes) < 0 ||
+			base_offset >= current)
+		goto corrupt;
+	head_bytes = codec_peek(stream, stream_bytes, head, 20);
+	if (head_bytes < 0 ||
+			(n = varint_decode(head, head_bytes, &base_bytes)) < 0 ||
+			varint_decode(head + n, head_bytes - n, bytes) < 0)
+		goto corrupt;
+	if (!type)
+		return 0;
+
+	current = base_offset;
+	for (depth = 1; depth <= PACK_DEPTH_MAX; depth++) {
+		if (base_cache_get(pack, current, type, NULL, NULL))
+			return 0;
+		if (pack_entry(pack, current, &kind, &data, &data_bytes) < 0)
+			goto corrupt;
+		if (kind == PACK_OBJECT) {
+			head_bytes = codec_peek(data, data_bytes, head, sizeof(head));
+			if (head_bytes < 0 ||
+					object_header_parse(head, head_bytes, type, &base_bytes) < 0)
+				goto corrupt;
+			return 0;
+		}
+		if (kind != PACK_DELTA ||
+				pack_delta_entry(data, data_bytes, &base_offset, &delta_bytes,
+					&stream, &stream_bytes) < 0 ||
+				base_offset >= current)
+			goto corrupt;
+		current = base_offset;
+	}
+
+corrupt:
+	asprintf(error, "corrupt entry at %lu in '%s.pack'", current, pack->path);
+	return -1;
+}
+
+uint8_t *pack_object_read(struct pack *pack, uint64_t offset,
+		char *type, uint64_t *buffer_bytes,
+		char **error)
+{
+	uint64_t chain[PACK_DEPTH_MAX + 1];
+	int depth;
+	int kind;
+	uint8_t *data;
+	uint64_t data_bytes;
+	uint64_t current;
+	char object_type[OBJECT_TYPE_BYTES];
+	uint8_t *base;
+	uint64_t base_bytes;
+	/* base is a copy of a cached one, not to be added again */
+	int base_cached;
+
+	/* walk down the delta chain up to a full object or a cached base */
+	depth = 0;
+	current = offset;
+	for (;;) {
+		if (depth > 0 && base_cache_get(pack, current, object_type,
+					&base, &base_bytes)) {
+			base_cached = 1;
+			break;
+		}
+
+		if (pack_entry(pack, current, &kind, &data, &data_bytes) < 0)
+			goto corrupt;
+
+		if (kind == PACK_OBJECT) {
+			base = file_sha1_inflate(data, data_bytes, object_type, &base_bytes);
+			if (!base)
+				goto corrupt;
+			base_cached = 0;
+			break;
+		}
+
+		if (kind != PACK_DELTA || depth == PACK_DEPTH_MAX)
+			goto corrupt;
+
+		chain[depth++] = current;
+		if (pack_delta_entry(data, data_bytes, &current, &base_bytes,
+					&data, &data_bytes) < 0 ||
+				current >= chain[depth - 1])
+			goto corrupt;
+	}
+
+	/* then apply the deltas back up */
+	while (depth > 0) {
+		uint64_t base_offset, delta_bytes, stream_bytes;
+		uint8_t *delta, *stream, *target;
+		size_t target_bytes;
+
+		current = chain[--depth];
+		if (pack_entry(pack, current, &kind, &data, &data_bytes) < 0 ||
+				pack_delta_entry(data, data_bytes, &base_offset,
+					&delta_bytes, &stream, &stream_bytes) < 0)
+			goto corrupt_base;
+
+		delta = pack_delta_inflate(stream, stream_bytes, delta_bytes);
+		if (!delta)
+			goto corrupt_base;
+		target = delta_apply(base, base_bytes, delta, delta_bytes,
+				&target_bytes);
+		free(delta);
+		if (!target)
+			goto corrupt_base;
+
+		/* the base we just used is worth keeping for its siblings */
+		if (base_cached || !base_cache_add(pack, base_offset, object_type,
+					base, base_bytes))
+			free(base);
+		base = target;
+		base_bytes = target_bytes;
+		base_cached = 0;
+	}
+
+	if (type)
+		strcpy(type, object_type);
+	*buffer_bytes = base_bytes;
+
+	return base;
+
+corrupt_base:
+	free(base);
+corrupt:
+	asprintf(error, "corrupt entry at %lu in '%s.pack'", current, pack->path);
+	return NULL;
+}
+
+/* Buffered output computing the sha1 of what it writes */
+struct pack_output {
+	int fd;
+	char path[PATH_MAX];
+	SHA_CTX ctx;
+	uint8_t *buffer;
+	size_t buffer_bytes;
+	uint64_t offset;
+};
+
+static int pack_output_open(struct pack_output *output, const char *directory,
+		char **error)
+{
+	memset(output, 0, sizeof(*output));
+	snprintf(output->path, sizeof(output->path), "%s/tmp_pack_XXXXXX",
+			directory);
+	output->fd = mkstemp(output->path);
+	if (output->fd < 0) {
+		asprintf(error, "mkstemp '%s' fail: %m", output->path);
+		return -1;
+	}
+	output->buffer = malloc(PACK_OUTPUT_BYTES);
+	if (!output->buffer) {
+		asprintf(error, "malloc fail: %m");
+		close(output->fd);
+		unlink(output->path);
+		return -1;
+	}
+	SHA1_Init(&output->ctx);
+
+	return 0;
+}
+
+static int pack_output_flush(struct pack_output *output, char **error)
+{
+	if (exact_write(output->fd, output->buffer, output->buffer_bytes,
+				error) < 0)
+		return -1;
+	output->buffer_bytes = 0;
+
+	return 0;
+}
+
+static int pack_output_write(struct pack_output *output,
+		const void *data, size_t bytes,
+		char **error)
+{
+	SHA1_Update(&output->ctx, data, bytes);
+	output->offset += bytes;
+
+	if (output->buffer_bytes + bytes > PACK_OUTPUT_BYTES) {
+		if (pack_output_flush(output, error) < 0)
+			return -1;
+		if (bytes > PACK_OUTPUT_BYTES)
+			return exact_write(output->fd, data, bytes, error);
+	}
+	memcpy(output->buffer + output->buffer_bytes, data, bytes);
+	output->buffer_bytes += bytes;
+
+	return 0;
+}
+
+/* Write the trailing sha1 and move the file to its final name */
+static int pack_output_close(struct pack_output *output, const char *filename,
+		uint8_t *sha1, char **error)
+{
+	uint8_t trailer[20];
+	int sync;
+
+	SHA1_Final(trailer, &output->ctx);
+	if (sha1)
+		memcpy(sha1, trailer, 20);
+	if (output->buffer_bytes + 20 > PACK_OUTPUT_BYTES &&
+			pack_output_flush(output, error) < 0)
+		goto fail;
+	memcpy(output->buffer + output->buffer_bytes, trailer, 20);
+	output->buffer_bytes += 20;
+
+	if (pack_output_flush(output, error) < 0)
+		goto fail;
+	free(output->buffer);
+	fchmod(output->fd, 0444);
+	/* loose objects may be pruned once the pack is in place */
+	sync = object_fsync_policy() != OBJECT_FSYNC_NONE;
+	if (sync && fdatasync(output->fd) < 0) {
+		asprintf(error, "fdatasync '%s' fail: %m", output->path);
+		close(output->fd);
+		unlink(output->path);
+		return -1;
+	}
+	close(output->fd);
+
+	if (rename(output->path, filename) < 0) {
+		asprintf(error, "rename '%s' fail: %m", filename);
+		unlink(output->path);
+		return -1;
+	}
+
+	if (sync) {
+		char directory[PATH_MAX];
+		int fd;
+
+		strcpy(directory, filename);
+		dirname(directory);
+		fd = open(directory, O_RDONLY|O_DIRECTORY);
+		if (fd < 0 || fsync(fd) < 0) {
+			asprintf(error, "fsync '%s' fail: %m", directory);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+
+fail:
+	free(output->buffer);
+	close(output->fd);
+	unlink(output->path);
+	return -1;
+}
+
+static void pack_output_abort(struct pack_output *output)
+{
+	free(output->buffer);
+	close(output->fd);
+	unlink(output->path);
+}
+
+static int sha1_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, 20);
+}
+
+/* Objects being packed. Delta bases are searched among the objects that
+ * precede in a window, once objects are sorted by type, name hash and size
+ * so that successive versions of a file end up next to each other. */
+struct pack_object {
+	uint8_t sha1[20];
+	char type[OBJECT_TYPE_BYTES];
+	uint64_t size;
+	uint32_t name_hash;
+	uint64_t offset;
+	int depth;
+};
+
+struct pack_window_entry {
+	struct pack_object *object;
+	uint8_t *payload;
+	uint64_t bytes;
+};
+
+/* Paths sharing their end (same file name or extension) get close hashes */
+static uint32_t name_hash(const char *name, size_t bytes)
+{
+	uint32_t hash = 0;
+	size_t i;
+
+	for (i = 0; i < bytes; i++) {
+		if (isspace(name[i]))
+			continue;
+		hash = (hash >> 2) + ((uint32_t) (uint8_t) name[i] << 24);
+	}
+
+	return hash;
+}
+
+static int pack_object_compare(const void *a, const void *b)
+{
+	return memcmp(((struct pack_object *) a)->sha1,
+			((struct pack_object *) b)->sha1, 20);
+}
+
+static int pack_object_order(const void *a, const void *b)
+{
+	const struct pack_object *oa = *(struct pack_object **) a;
+	const struct pack_object *ob = *(struct pack_object **) b;
+	int result;
+
+	result = strcmp(oa->type, ob->type);
+	if (result)
+		return result;
+	if (oa->name_hash != ob->name_hash)
+		return oa->name_hash < ob->name_hash ? -1 : 1;
+	/* bigger first: deltas removing data are smaller than adding it */
+	if (oa->size != ob->size)
+		return oa->size > ob->size ? -1 : 1;
+	return memcmp(oa->sha1, ob->sha1, 20);
+}
+
+/* Name the objects referenced by a tree after their path */
+static void pack_objects_name(struct pack_object *objects, size_t count,
+		uint8_t *tree, uint64_t bytes)
+{
+	uint8_t *p, *end;
+
+	p = tree;
+	end = tree + bytes;
+	while (p < end) {
+		uint8_t *name, *nul;
+		struct pack_object key, *object;
+
+		name = memchr(p, ' ', end - p);
+		if (!name)
+			break;
+		name++;
+		nul = memchr(name, '\0', end - name);
+		if (!nul || nul + 21 > end)
+			break;
+
+		memcpy(key.sha1, nul + 1, 20);
+		object = bsearch(&key, objects, count, sizeof(key), pack_object_compare);
+		if (object)
+			object->name_hash = name_hash((char *) name, nul - name);
+		p = nul + 21;
+	}
+}
+
+/* Compress header and payload with the configured codec into memory */
+static uint8_t *pack_compress(const void *header, size_t header_bytes,
+		const void *payload, size_t payload_bytes,
+		uint64_t *bytes)
+{
+	struct codec_stream stream;
+	const struct codec *codec;
+	uint8_t *out;
+	size_t out_bytes;
+	int level;
+	int result;
+
+	codec = codec_default(&level, Z_DEFAULT_COMPRESSION);
+	out_bytes = compressBound(header_bytes + payload_bytes) + 1;
+	out = malloc(out_bytes);
+	if (!out)
+		return NULL;
+	if (codec_compress_init(&stream, codec, level) < 0) {
+		free(out);
+		return NULL;
+	}
+
+	stream.z.next_out = out;
+	stream.z.avail_out = out_bytes;
+	stream.z.next_in = (uint8_t *) header;
+	stream.z.avail_in = header_bytes;
+	result = codec_compress(&stream, 0);
+	if (result == CODEC_OK) {
+		stream.z.next_in = (uint8_t *) payload;
+		stream.z.avail_in = payload_bytes;
+		result = codec_compress(&stream, 1);
+	}
+	codec_compress_end(&stream);
+	if (result != CODEC_END) {
+		free(out);
+		return NULL;
+	}
+	*bytes = out_bytes - stream.z.avail_out;
+
+	return out;
+}
+
+int object_raw(uint8_t *sha1, uint8_t **data, uint64_t *data_bytes,
+		int *mapped)
+{
+	struct pack *pack;
+	uint64_t offset;
+	size_t map_bytes;
+	int kind;
+	char *error = NULL;
+
+	*mapped = 0;
+	if (pack_find(sha1, &pack, &offset))
+		return pack_entry(pack, offset, &kind, data, data_bytes) == 0 &&
+			kind == PACK_OBJECT;
+
+	*data = file_sha1_map(sha1, &map_bytes, &error);
+	free(error);
+	if (!*data)
+		return 0;
+	*data_bytes = map_bytes;
+	*mapped = 1;
+
+	return 1;
+}
+
+/* Best delta of object against the window, NULL if none beats max_bytes */
+static uint8_t *pack_delta_find(struct pack_window_entry *window, int window_size,
+		struct pack_object *object, uint8_t *payload,
+		uint64_t max_bytes, int depth_max,
+		struct pack_object **base, size_t *delta_bytes)
+{
+	uint8_t *best;
+	int i;
+
+	best = NULL;
+	for (i = 0; i < window_size; i++) {
+		struct pack_window_entry *w = &window[i];
+		uint8_t *delta;
+		size_t bytes;
+
+		if (!w->object || strcmp(w->object->type, object->type) ||
+				w->object->depth >= depth_max)
+			continue;
+		/* a base much smaller than the object cannot describe it */
+		if (w->bytes < object->size / 4)
+			continue;
+
+		delta = delta_create(w->payload, w->bytes, payload, object->size,
+				max_bytes, &bytes);
+		if (!delta)
+			continue;
+		free(best);
+		best = delta;
+		*delta_bytes = max_bytes = bytes;
+		*base = w->object;
+	}
+
+	return best;
+}
+
+/* entry data is made of a (possibly empty) header and a stream */
+static int pack_entry_write(struct pack_output *pack, int kind,
+		const void *header, size_t header_bytes,
+		const void *data, uint64_t data_bytes,
+		char **error)
+{
+	uint8_t entry[1 + 10];
+	size_t entry_bytes;
+
+	entry[0] = kind;
+	entry_bytes = 1 + varint_encode(entry + 1, header_bytes + data_bytes);
+	if (pack_output_write(pack, entry, entry_bytes, error) < 0 ||
+			pack_output_write(pack, header, header_bytes, error) < 0)
+		return -1;
+
+	return pack_output_write(pack, data, data_bytes, error);
+}
+
+static int pack_object_write(struct pack_output *pack,
+		struct pack_object *object, uint8_t *payload,
+		struct pack_window_entry *window, int window_size, int depth_max,
+		char **error)
+{
+	uint8_t *raw, *delta;
+	uint64_t raw_bytes;
+	struct pack_object *base;
+	size_t delta_bytes;
+	int mapped;
+	int result;
+
+	object->offset = pack->offset;
+
+	if (!object_raw(object->sha1, &raw, &raw_bytes, &mapped)) {
+		char header[64];
+		int header_bytes;
+
+		header_bytes = snprintf(header, sizeof(header), "%s %lu",
+				object->type, object->size) + 1;
+		raw = pack_compress(header, header_bytes, payload, object->size,
+				&raw_bytes);
+		if (!raw) {
+			asprintf(error, "compression of '%s' fail", sha12hex(object->sha1));
+			return -1;
+		}
+		mapped = -1;
+	}
+
+	delta = pack_delta_find(window, window_size, object, payload, raw_bytes,
+			depth_max, &base, &delta_bytes);
+	if (delta) {
+		uint8_t *stream;
+		uint64_t stream_bytes;
+		uint8_t header[20];
+		size_t header_bytes;
+
+		stream = pack_compress(NULL, 0, delta, delta_bytes, &stream_bytes);
+		free(delta);
+		header_bytes = varint_encode(header, base->offset);
+		header_bytes += varint_encode(header + header_bytes, delta_bytes);
+
+		/* compressed deltas of incompressible data may not be worth it */
+		if (stream && header_bytes + stream_bytes < raw_bytes) {
+			result = pack_entry_write(pack, PACK_DELTA, header, header_bytes,
+					stream, stream_bytes, error);
+			free(stream);
+			object->depth = base->depth + 1;
+			goto out;
+		}
+		free(stream);
+	}
+
+	result = pack_entry_write(pack, PACK_OBJECT, NULL, 0, raw, raw_bytes, error);
+
+out:
+	if (mapped > 0)
+		munmap(raw, raw_bytes);
+	else if (mapped < 0)
+		free(raw);
+
+	return result;
+}
+
+int pack_write(uint8_t (*sha1s)[20], size_t count, uint8_t *pack_sha1,
+		char **error)
+{
+	char directory[PATH_MAX];
+	char filename[PATH_MAX + 64];
+	struct pack_output pack, index;
+	struct pack_header header;
+	struct pack_index_header index_header;
+	struct pack_object *objects, **order;
+	struct pack_window_entry *window;
+	int window_size, depth_max;
+	uint8_t pack_checksum[20];
+	SHA_CTX ctx;
+	size_t i;
+
+	pack_directory(directory, sizeof(directory));
+	if (mkdir(directory, 0775) < 0 && errno != EEXIST) {
+		asprintf(error, "mkdir '%s' fail: %m", directory);
+		return -1;
+	}
+
+	window_size = config_get_int("pack.window", "GT_PACK_WINDOW",
+			PACK_WINDOW_DEFAULT);
+	if (window_size < 0)
+		window_size = 0;
+	depth_max = config_get_int("pack.depth", "GT_PACK_DEPTH", PACK_DEPTH_MAX);
+	if (depth_max < 0 || depth_max > PACK_DEPTH_MAX)
+		depth_max = PACK_DEPTH_MAX;
+
+	qsort(sha1s, count, 20, sha1_compare);
+
+	/* drop duplicates */
+	for (i = 1; i < count; ) {
+		if (!memcmp(sha1s[i - 1], sha1s[i], 20)) {
+			memmove(sha1s[i], sha1s[i + 1], (count - i - 1) * 20);
+			count--;
+			continue;
+		}
+		i++;
+	}
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, sha1s, count * 20);
+	SHA1_Final(pack_sha1, &ctx);
+
+	objects = calloc(count + 1, sizeof(*objects));
+	order = malloc((count + 1) * sizeof(*order));
+	window = calloc(window_size + 1, sizeof(*window));
+	if (!objects || !order || !window) {
+		asprintf(error, "malloc fail: %m");
+		goto fail_alloc;
+	}
+
+	/* types and sizes to sort objects, trees to name them */
+	for (i = 0; i < count; i++)
+		memcpy(objects[i].sha1, sha1s[i], 20);
+	for (i = 0; i < count; i++) {
+		uint8_t *payload;
+
+		if (object_info(objects[i].sha1, objects[i].type, &objects[i].size,
+					error) < 0)
+			goto fail_alloc;
+		order[i] = &objects[i];
+		if (strcmp(objects[i].type, "tree"))
+			continue;
+		payload = object_read(objects[i].sha1, NULL, &objects[i].size, error);
+		if (!payload)
+			goto fail_alloc;
+		pack_objects_name(objects, count, payload, objects[i].size);
+		free(payload);
+	}
+	qsort(order, count, sizeof(*order), pack_object_order);
+
+	if (pack_output_open(&pack, directory, error) < 0)
+		goto fail_alloc;
+
+	header.signature = PACK_SIGNATURE;
+	header.version = PACK_VERSION;
+	header.objects_count = count;
+	if (pack_output_write(&pack, &header, sizeof(header), error) < 0)
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		struct pack_object *object = order[i];
+		struct pack_window_entry *slot;
+		uint8_t *payload;
+		uint64_t bytes;
+
+		payload = object_read(object->sha1, NULL, &bytes, error);
+		if (!payload)
+			goto fail;
+		if (pack_object_write(&pack, object, payload, window, window_size,
+					depth_max, error) < 0) {
+			free(payload);
+			goto fail;
+		}
+
+		if (!window_size) {
+			free(payload);
+			continue;
+		}
+		slot = &window[i % window_size];
+		free(slot->payload);
+		slot->object = object;
+		slot->payload = payload;
+		slot->bytes = bytes;
+	}
+
+	snprintf(filename, sizeof(filename), "%s/pack-%s.pack",
+			directory, sha12hex(pack_sha1));
+	if (pack_output_close(&pack, filename, pack_checksum, error) < 0)
+		goto fail_alloc;
+
+	if (pack_output_open(&index, directory, error) < 0)
+		goto fail_alloc;
+
+	memset(&index_header, 0, sizeof(index_header));
+	index_header.signature = PACK_INDEX_SIGNATURE;
+	index_header.version = PACK_VERSION;
+	for (i = 0; i < count; i++)
+		index_header.fanout[objects[i].sha1[0]]++;
+	for (i = 1; i < 256; i++)
+		index_header.fanout[i] += index_header.fanout[i - 1];
+
+	if (pack_output_write(&index, &index_header, sizeof(index_header),
+				error) < 0)
+		goto fail_index;
+	for (i = 0; i < count; i++) {
+		if (pack_output_write(&index, objects[i].sha1, 20, error) < 0)
+			goto fail_index;
+	}
+	for (i = 0; i < count; i++) {
+		if (pack_output_write(&index, &objects[i].offset,
+					sizeof(objects[i].offset), error) < 0)
+			goto fail_index;
+	}
+	if (pack_output_write(&index, pack_checksum, 20, error) < 0)
+		goto fail_index;
+
+	/* the index goes last: a pack is not visible until it is complete */
+	snprintf(filename, sizeof(filename), "%s/pack-%s.idx",
+			directory, sha12hex(pack_sha1));
+	if (pack_output_close(&index, filename, NULL, error) < 0)
+		goto fail_alloc;
+
+	for (i = 0; i < window_size; i++)
+		free(window[i].payload);
+	free(window);
+	free(order);
+	free(objects);
+
+	return 0;
+
+fail_index:
+	pack_output_abort(&index);
+	goto fail_alloc;
+fail:
+	pack_output_abort(&pack);
+fail_alloc:
+	if (window) {
+		for (i = 0; i < window_size; i++)
+			free(window[i].payload);
+	}
+	free(window);
+	free(order);
+	free(objects);
+	return -1;
+}
@@ -0,0 +1,88 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A pack stores many objects in a single file, next to an index used to find
+ * them without reading the pack:
+ *
+ * objects/pack/pack-<sha1>.pack
+ *   struct pack_header
+ *   entries: kind (1 byte), data length (varint), data
+ *   sha1 of everything above
+ *
+ * objects/pack/pack-<sha1>.idx
+ *   struct pack_index_header, with the fanout table: fanout[b] is the number
+ *   of objects whose sha1 first byte is <= b
+ *   sha1s, 20 bytes each, sorted
+ *   offsets of the entries in the pack, 64 bits each
+ *   sha1 of the pack, sha1 of everything above
+ *
+ * A PACK_OBJECT entry holds the object exactly as a loose object file would
+ * (codec stream of "type size\0payload"). A PACK_DELTA entry holds the
+ * offset of its base entry, earlier in the same pack, and the size of the
+ * delta (varints) followed by the codec stream of the delta (see delta.h).
+ * The object has the type of its base. Delta chains are at most
+ * PACK_DEPTH_MAX long. The pack name is the sha1 of the sorted object ids it
+ * contains. */
+
+#define PACK_SIGNATURE			0x4B434150	/* "PACK" */
+#define PACK_INDEX_SIGNATURE	0x58444950	/* "PIDX" */
+#define PACK_VERSION			1
+
+#define PACK_OBJECT		1
+#define PACK_DELTA		2
+
+#define PACK_DEPTH_MAX	50
+
+struct pack_header {
+	uint32_t signature;
+	uint32_t version;
+	uint32_t objects_count;
+} __attribute__ ((packed));
+
+struct pack_index_header {
+	uint32_t signature;
+	uint32_t version;
+	uint32_t fanout[256];
+} __attribute__ ((packed));
+
+struct pack {
+	char *path;
+	uint8_t *data;
+	size_t data_bytes;
+	uint8_t *index;
+	size_t index_bytes;
+	uint32_t objects_count;
+	uint32_t *fanout;
+	uint8_t *sha1s;
+	uint64_t *offsets;
+	struct pack *next;
+};
+
+/* Look sha1 up in the packs of the repository, which are loaded on first
+ * use. Returns 1 and the pack and entry offset when found. */
+int pack_find(uint8_t *sha1, struct pack **pack, uint64_t *offset);
+
+/* Type and size of the object at offset, without rebuilding it */
+int pack_object_info(struct pack *pack, uint64_t offset,
+		char *type, uint64_t *bytes,
+		char **error);
+
+uint8_t *pack_object_read(struct pack *pack, uint64_t offset,
+		char *type, uint64_t *buffer_bytes,
+		char **error);
+
+/* Raw bytes of an object stored in full: a mapped loose file (*mapped is
+ * set, munmap it) or an entry of a pack. Returns 0 when the object is only
+ * available as a delta. */
+int object_raw(uint8_t *sha1, uint8_t **data, uint64_t *data_bytes,
+		int *mapped);
+
+/* Write the given objects, loose or from other packs, in a new pack and
+ * return its name (the pack sha1). */
+int pack_write(uint8_t (*sha1s)[20], size_t count, uint8_t *pack_sha1,
+		char **error);
+
+#endif /* PACK_H */
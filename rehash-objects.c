@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <libgen.h>
+#include <linux/limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "index.h"
+
+/* Convert a format 1 object database, where objects are named after the sha1
+ * of their deflated stream, to format 2 where they are named after the sha1
+ * of "type size\0payload". Trees and commits refer to other objects by sha1,
+ * so they are rewritten once the objects they point to have been converted.
+ * The index and HEAD are updated last, then the old objects are removed. */
+
+struct rehash_entry {
+	uint8_t old_sha1[20];
+	uint8_t new_sha1[20];
+	int done;
+};
+
+struct rehash {
+	struct rehash_entry *entries;
+	size_t entries_count;
+	size_t allocated;
+
+	/* objects waiting for the objects they refer to */
+	struct rehash_entry **stack;
+	size_t stack_count;
+	size_t stack_allocated;
+};
+
+static int usage(const char *program,
+		int return_value,
+		const char *message, ...)
+{
+	if (message) {
+		va_list ap;
+
+		va_start(ap, message);
+		vfprintf(stderr, message, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "usage: %s [--help|-h] [--verbose|-v]\n", program);
+
+	return return_value;
+}
+
+static int rehash_entry_compare(const void *a, const void *b)
+{
+	const struct rehash_entry *ea = a, *eb = b;
+
+	return memcmp(ea->old_sha1, eb->old_sha1, 20);
+}
+
+static struct rehash_entry *rehash_lookup(struct rehash *rehash, uint8_t *sha1)
+{
+	struct rehash_entry key;
+
+	memcpy(key.old_sha1, sha1, 20);
+	return bsearch(&key, rehash->entries, rehash->entries_count,
+			sizeof(key), rehash_entry_compare);
+}
+
+static int rehash_add(uint8_t *sha1, void *data, char **error)
+{
+	struct rehash *rehash = data;
+	struct rehash_entry *entry;
+
+	if (rehash->entries_count == rehash->allocated) {
+		void *ptr;
+
+		rehash->allocated = rehash->allocated ? rehash->allocated * 2 : 1024;
+		ptr = realloc(rehash->entries,
+				rehash->allocated * sizeof(*rehash->entries));
+		if (!ptr) {
+			asprintf(error, "realloc fail: %m");
+			return -1;
+		}
+		rehash->entries = ptr;
+	}
+	entry = &rehash->entries[rehash->entries_count++];
+	memset(entry, 0, sizeof(*entry));
+	memcpy(entry->old_sha1, sha1, 20);
+
+	return 0;
+}
+
+static int rehash_list(struct rehash *rehash, char **error)
+{
+	if (object_loose_for_each(rehash_add, rehash, error) < 0)
+		return -1;
+
+	qsort(rehash->entries, rehash->entries_count, sizeof(*rehash->entries),
+			rehash_entry_compare);
+
+	return 0;
+}
+
+/* Calls fn on every object id referenced by a tree or a commit payload. The
+ * references are rewritten in place: ids keep the same length. */
+static int references_walk(const char *type, uint8_t *payload, size_t bytes,
+		int (*fn)(struct rehash *, uint8_t *sha1, void *), struct rehash *rehash,
+		void *data)
+{
+	uint8_t *p, *end;
+	int count;
+
+	count = 0;
+	end = payload + bytes;
+	if (!strcmp(type, "tree")) {
+		p = payload;
+		while (p < end) {
+			p = memchr(p, '\0', end - p);
+			if (!p || p + 21 > end)
+				break;
+			count += fn(rehash, p + 1, data);
+			p += 21;
+		}
+	} else if (!strcmp(type, "commit")) {
+		p = payload;
+		while (p < end && *p != '\n') {
+			uint8_t *eol = memchr(p, '\n', end - p);
+			uint8_t *hex = NULL;
+
+			if (!eol)
+				break;
+			if (eol - p == 45 && !memcmp(p, "tree ", 5))
+				hex = p + 5;
+			else if (eol - p == 47 && !memcmp(p, "parent ", 7))
+				hex = p + 7;
+			if (hex) {
+				char ascii[41];
+				uint8_t sha1[20];
+
+				memcpy(ascii, hex, 40);
+				ascii[40] = '\0';
+				if (hex2sha1(ascii, sha1) == 0) {
+					count += fn(rehash, sha1, data);
+					memcpy(hex, sha12hex(sha1), 40);
+				}
+			}
+			p = eol + 1;
+		}
+	}
+
+	return count;
+}
+
+static int rehash_push(struct rehash *rehash, struct rehash_entry *entry)
+{
+	if (rehash->stack_count == rehash->stack_allocated) {
+		void *ptr;
+		size_t allocated;
+
+		allocated = rehash->stack_allocated ? rehash->stack_allocated * 2 : 256;
+		ptr = realloc(rehash->stack, allocated * sizeof(*rehash->stack));
+		if (!ptr)
+			return -1;
+		rehash->stack = ptr;
+		rehash->stack_allocated = allocated;
+	}
+	rehash->stack[rehash->stack_count++] = entry;
+
+	return 0;
+}
+
+/* Count (and queue) the references which are not converted yet */
+static int reference_pending(struct rehash *rehash, uint8_t *sha1, void *data)
+{
+	struct rehash_entry *entry;
+	int *fail = data;
+
+	entry = rehash_lookup(rehash, sha1);
+	if (!entry || entry->done)
+		return 0;
+
+	if (rehash_push(rehash, entry) < 0)
+		*fail = 1;
+	return 1;
+}
+
+static int reference_rewrite(struct rehash *rehash, uint8_t *sha1, void *data)
+{
+	struct rehash_entry *entry;
+
+	entry = rehash_lookup(rehash, sha1);
+	if (entry)
+		memcpy(sha1, entry->new_sha1, 20);
+	else
+		fprintf(stderr, "warning: missing object '%s'\n", sha12hex(sha1));
+
+	return 0;
+}
+
+/* Depth first conversion without recursion: history can be deep */
+static int rehash_object(struct rehash *rehash, struct rehash_entry *root,
+		int verbose,
+		char **error)
+{
+	rehash->stack_count = 0;
+	if (rehash_push(rehash, root) < 0)
+		goto fail_alloc;
+
+	while (rehash->stack_count > 0) {
+		struct rehash_entry *entry = rehash->stack[rehash->stack_count - 1];
+		char type[OBJECT_TYPE_BYTES];
+		uint8_t *payload;
+		uint64_t bytes;
+		int fail;
+
+		if (entry->done) {
+			rehash->stack_count--;
+			continue;
+		}
+
+		payload = object_read(entry->old_sha1, type, &bytes, error);
+		if (!payload)
+			return -1;
+
+		fail = 0;
+		if (references_walk(type, payload, bytes, reference_pending,
+					rehash, &fail)) {
+			free(payload);
+			if (fail)
+				goto fail_alloc;
+			continue;
+		}
+
+		references_walk(type, payload, bytes, reference_rewrite, rehash, NULL);
+		if (object_hash(payload, bytes, type, 1, entry->new_sha1, error) < 0) {
+			free(payload);
+			return -1;
+		}
+		free(payload);
+		entry->done = 1;
+		rehash->stack_count--;
+
+		if (verbose) {
+			char old_hex[41];
+
+			strcpy(old_hex, sha12hex(entry->old_sha1));
+			fprintf(stdout, "%s -> %s\n", old_hex, sha12hex(entry->new_sha1));
+		}
+	}
+
+	return 0;
+
+fail_alloc:
+	asprintf(error, "realloc fail: %m");
+	return -1;
+}
+
+static int head_rewrite(struct rehash *rehash, const char *directory,
+		char **error)
+{
+	char path[PATH_MAX];
+	char hex[41];
+	uint8_t sha1[20];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/HEAD", directory);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(hex, sizeof(hex), f) || hex2sha1(hex, sha1) < 0) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	reference_rewrite(rehash, sha1, NULL);
+
+	f = fopen(path, "w");
+	if (!f) {
+		asprintf(error, "open '%s' fail: %m", path);
+		return -1;
+	}
+	fprintf(f, "%s", sha12hex(sha1));
+	fclose(f);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int verbose;
+	char *directory;
+	char *error;
+	struct rehash rehash;
+	struct index *index;
+	char *filename;
+	size_t removed;
+
+	verbose = 0;
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "--help", sizeof("--help")) ||
+				!strncmp(arg, "-h", sizeof("-h")))
+			return usage(argv[0], 0, NULL);
+		if (!strncmp(arg, "--verbose", sizeof("--verbose")) ||
+				!strncmp(arg, "-v", sizeof("-v"))) {
+			verbose = 1;
+			continue;
+		}
+
+		return usage(argv[0], 1, "Unknown option '%s'", arg);
+	}
+
+	if (!gt_directory_check(&error)) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
+
+	/* every object written from now on is named after its content */
+	setenv("GT_OBJECT_FORMAT", "2", 1);
+
+	if (!(directory = getenv("GT_DIRECTORY")))
+		directory = GT_DEFAULT_DIRECTORY;
+
+	memset(&rehash, 0, sizeof(rehash));
+	if (rehash_list(&rehash, &error) < 0)
+		goto fail;
+
+	object_batch_begin();
+	for (i = 0; i < rehash.entries_count; i++) {
+		if (rehash_object(&rehash, &rehash.entries[i], verbose, &error) < 0)
+			goto fail;
+	}
+	free(rehash.stack);
+	rehash.stack = NULL;
+	if (object_batch_end(&error) < 0)
+		goto fail;
+
+	index = index_open(&error);
+	if (!index)
+		goto fail;
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = index_entry_modify(index, i, &error);
+
+		if (!entry) {
+			index_free(index);
+			goto fail;
+		}
+		reference_rewrite(&rehash, entry->sha1, NULL);
+	}
+	/* cached trees have new names too */
+	tree_cache_free(index->tree);
+	index->tree = NULL;
+	if (index_close(index, &error) < 0)
+		goto fail;
+
+	if (head_rewrite(&rehash, directory, &error) < 0)
+		goto fail;
+
+	if (config_set("core.objectformat", "2", &error) < 0)
+		goto fail;
+
+	removed = 0;
+	for (i = 0; i < rehash.entries_count; i++) {
+		struct rehash_entry *entry = &rehash.entries[i];
+
+		if (!memcmp(entry->old_sha1, entry->new_sha1, 20))
+			continue;
+		filename = sha1_filename(entry->old_sha1);
+		if (unlink(filename) == 0) {
+			removed++;
+			/* only succeeds once the fan-out directory is empty */
+			rmdir(dirname(filename));
+		}
+	}
+
+	fprintf(stderr, "%zu objects rehashed, %zu renamed\n",
+			rehash.entries_count, removed);
+	free(rehash.entries);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "%s\n", error);
+	free(error);
+	free(rehash.stack);
+	free(rehash.entries);
+	return 1;
+}
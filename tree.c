@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "tree.h"
+
+const uint8_t null_sha1[20];
+
+/* fixed part of a serialized node, after its name */
+#define TREE_CACHE_NODE_BYTES	(4 + 4 + 20)
+
+struct tree_cache *tree_cache_create(const char *name, size_t name_bytes)
+{
+	struct tree_cache *tree;
+
+	tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		return NULL;
+	tree->name = strndup(name, name_bytes);
+	if (!tree->name) {
+		free(tree);
+		return NULL;
+	}
+	tree->entries_count = -1;
+
+	return tree;
+}
+
+void tree_cache_free(struct tree_cache *tree)
+{
+	int i;
+
+	if (!tree)
+		return;
+	for (i = 0; i < tree->subtrees_count; i++)
+		tree_cache_free(tree->subtrees[i]);
+	free(tree->subtrees);
+	free(tree->name);
+	free(tree);
+}
+
+struct tree_cache *tree_cache_subtree(struct tree_cache *tree,
+		const char *name, size_t name_bytes, int create)
+{
+	struct tree_cache *subtree;
+	void *ptr;
+	int i;
+
+	for (i = 0; i < tree->subtrees_count; i++) {
+		subtree = tree->subtrees[i];
+		if (!strncmp(subtree->name, name, name_bytes) &&
+				subtree->name[name_bytes] == '\0')
+			return subtree;
+	}
+	if (!create)
+		return NULL;
+
+	ptr = realloc(tree->subtrees,
+			(tree->subtrees_count + 1) * sizeof(*tree->subtrees));
+	if (!ptr)
+		return NULL;
+	tree->subtrees = ptr;
+	subtree = tree_cache_create(name, name_bytes);
+	if (!subtree)
+		return NULL;
+	tree->subtrees[tree->subtrees_count++] = subtree;
+
+	return subtree;
+}
+
+void tree_cache_invalidate(struct tree_cache *tree,
+		const char *path, size_t path_bytes)
+{
+	const char *slash;
+
+	while (tree) {
+		tree->entries_count = -1;
+		slash = memchr(path, '/', path_bytes);
+		if (!slash)
+			break;
+		tree = tree_cache_subtree(tree, path, slash - path, 0);
+		path_bytes -= slash + 1 - path;
+		path = slash + 1;
+	}
+}
+
+size_t tree_cache_bytes(struct tree_cache *tree)
+{
+	size_t bytes;
+	int i;
+
+	bytes = strlen(tree->name) + 1 + TREE_CACHE_NODE_BYTES;
+	for (i = 0; i < tree->subtrees_count; i++)
+		bytes += tree_cache_bytes(tree->subtrees[i]);
+
+	return bytes;
+}
+
+uint8_t *tree_cache_serialize(struct tree_cache *tree, uint8_t *data)
+{
+	size_t name_bytes;
+	int i;
+
+	name_bytes = strlen(tree->name) + 1;
+	memcpy(data, tree->name, name_bytes);
+	data += name_bytes;
+	memcpy(data, &tree->entries_count, 4);
+	memcpy(data + 4, &tree->subtrees_count, 4);
+	memcpy(data + 8, tree->sha1, 20);
+	data += TREE_CACHE_NODE_BYTES;
+	for (i = 0; i < tree->subtrees_count; i++)
+		data = tree_cache_serialize(tree->subtrees[i], data);
+
+	return data;
+}
+
+static struct tree_cache *tree_cache_node_parse(const uint8_t **data,
+		const uint8_t *end)
+{
+	struct tree_cache *tree;
+	const uint8_t *nul;
+	uint32_t subtrees_count;
+	int i;
+
+	nul = memchr(*data, '\0', end - *data);
+	if (!nul || end - (nul + 1) < TREE_CACHE_NODE_BYTES)
+		return NULL;
+	memcpy(&subtrees_count, nul + 1 + 4, 4);
+	/* each subtree takes at least a NUL and the fixed part */
+	if (subtrees_count > (end - nul) / (1 + TREE_CACHE_NODE_BYTES))
+		return NULL;
+
+	tree = tree_cache_create((const char *) *data, nul - *data);
+	if (!tree)
+		return NULL;
+	memcpy(&tree->entries_count, nul + 1, 4);
+	memcpy(tree->sha1, nul + 1 + 8, 20);
+	*data = nul + 1 + TREE_CACHE_NODE_BYTES;
+
+	tree->subtrees = calloc(subtrees_count, sizeof(*tree->subtrees));
+	if (!tree->subtrees && subtrees_count)
+		goto fail;
+	for (i = 0; i < subtrees_count; i++) {
+		tree->subtrees[i] = tree_cache_node_parse(data, end);
+		if (!tree->subtrees[i])
+			goto fail;
+		tree->subtrees_count++;
+	}
+
+	return tree;
+
+fail:
+	tree_cache_free(tree);
+	return NULL;
+}
+
+struct tree_cache *tree_cache_parse(const uint8_t *data, size_t bytes)
+{
+	return tree_cache_node_parse(&data, data + bytes);
+}
+
+const struct cached_object *tree_object_get(uint8_t *sha1, char **error)
+{
+	const struct cached_object *object;
+	uint8_t tree_sha1[20];
+	char hex[41];
+
+	object = object_cache_get(sha1, error);
+	if (!object)
+		return NULL;
+	if (!strcmp(object->type, "tree"))
+		return object;
+
+	/* a commit starts with "tree <sha1>\n" */
+	if (strcmp(object->type, "commit") || object->bytes < 5 + 40 ||
+			memcmp(object->data, "tree ", 5)) {
+		asprintf(error, "object '%s' is a %s, not a tree",
+				sha12hex(sha1), object->type);
+		object_cache_put(object);
+		return NULL;
+	}
+	memcpy(hex, object->data + 5, 40);
+	hex[40] = '\0';
+	object_cache_put(object);
+	if (hex2sha1(hex, tree_sha1) < 0) {
+		asprintf(error, "commit '%s' has a bad tree", sha12hex(sha1));
+		return NULL;
+	}
+
+	return tree_object_get(tree_sha1, error);
+}
+
+int tree_entry_next(const uint8_t **data, const uint8_t *end,
+		struct tree_entry *entry)
+{
+	const uint8_t *p = *data;
+	const uint8_t *nul;
+
+	if (p == end)
+		return 1;
+
+	/* "<mode in octal> <name>\0<20 bytes sha1>" */
+	entry->mode = 0;
+	while (p < end && *p >= '0' && *p <= '7')
+		entry->mode = (entry->mode << 3) | (*p++ - '0');
+	if (p == *data || p == end || *p++ != ' ')
+		return -1;
+	nul = memchr(p, '\0', end - p);
+	if (!nul || nul == p || end - (nul + 1) < 20)
+		return -1;
+	entry->name = (const char *) p;
+	entry->name_bytes = nul - p;
+	entry->sha1 = nul + 1;
+	*data = nul + 1 + 20;
+
+	return 0;
+}
+
+int tree_entry_compare(const char *a, size_t a_bytes, int a_tree,
+		const char *b, size_t b_bytes, int b_tree)
+{
+	size_t bytes = a_bytes < b_bytes ? a_bytes : b_bytes;
+	int result;
+	int ca, cb;
+
+	result = memcmp(a, b, bytes);
+	if (result)
+		return result;
+	/* the first character past the common part, a slash for trees */
+	ca = bytes < a_bytes ? (unsigned char) a[bytes] : a_tree ? '/' : 0;
+	cb = bytes < b_bytes ? (unsigned char) b[bytes] : b_tree ? '/' : 0;
+
+	return ca - cb;
+}
+
+int tree_diff_change(struct tree_diff *diff, size_t path_bytes,
+		uint32_t mode_a, const uint8_t *sha1_a,
+		uint32_t mode_b, const uint8_t *sha1_b)
+{
+	char hex_a[41], hex_b[41];
+	char status;
+	int result;
+
+	status = !mode_a ? 'A' : !mode_b ? 'D' : 'M';
+	switch (diff->output) {
+	case TREE_DIFF_NAME_ONLY:
+		result = buffer_sprintf(&diff->out, "%.*s\n", (int) path_bytes,
+				diff->path);
+		break;
+	case TREE_DIFF_NAME_STATUS:
+		result = buffer_sprintf(&diff->out, "%c\t%.*s\n", status,
+				(int) path_bytes, diff->path);
+		break;
+	default:
+		sha12hex_r((uint8_t *) sha1_a, hex_a);
+		sha12hex_r((uint8_t *) sha1_b, hex_b);
+		result = buffer_sprintf(&diff->out, ":%06o %06o %s %s %c\t%.*s\n",
+				mode_a, mode_b, hex_a, hex_b, status,
+				(int) path_bytes, diff->path);
+		break;
+	}
+	if (result < 0) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	return buffer_flush(&diff->out, BUFFER_FLUSH_BYTES);
+}
+
+size_t tree_diff_path_append(struct tree_diff *diff, size_t prefix_bytes,
+		struct tree_entry *entry)
+{
+	if (prefix_bytes + entry->name_bytes + 2 > sizeof(diff->path)) {
+		fprintf(stderr, "path too long: '%.*s%.*s'\n", (int) prefix_bytes,
+				diff->path, (int) entry->name_bytes, entry->name);
+		return 0;
+	}
+	memcpy(diff->path + prefix_bytes, entry->name, entry->name_bytes);
+
+	return prefix_bytes + entry->name_bytes;
+}
@@ -0,0 +1,103 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+
+/* Trees are written one per directory, git style: entries sorted by name,
+ * each one "<mode in octal> <name>\0<20 bytes sha1>", subdirectories having
+ * the TREE_MODE mode. As the index is sorted by path, the entries of a
+ * directory are contiguous in it.
+ *
+ * The tree cache remembers, for every directory of the index, the sha1 of
+ * its tree and how many index entries it covers, so that write-tree only
+ * rebuilds the directories which changed. Adding an entry invalidates the
+ * directories on its path (entries_count becomes -1). The cache is saved
+ * in the index, as an extension after the entries:
+ *
+ *   signature (TREE_CACHE_SIGNATURE), size of the data (32 bits)
+ *   nodes, depth first: name, NUL, entries_count (32 bits, signed),
+ *   subtrees_count (32 bits), sha1 */
+
+#define TREE_MODE				040000
+#define TREE_CACHE_SIGNATURE	0x45455254	/* "TREE" */
+
+struct tree_cache {
+	char *name;
+	int32_t entries_count;
+	uint32_t subtrees_count;
+	struct tree_cache **subtrees;
+	uint8_t sha1[20];
+};
+
+struct tree_cache *tree_cache_create(const char *name, size_t name_bytes);
+void tree_cache_free(struct tree_cache *tree);
+
+/* The subtree for the directory name, created when missing if create */
+struct tree_cache *tree_cache_subtree(struct tree_cache *tree,
+		const char *name, size_t name_bytes, int create);
+
+/* Invalidate the directories leading to path */
+void tree_cache_invalidate(struct tree_cache *tree,
+		const char *path, size_t path_bytes);
+
+/* An entry of a tree object, pointing into its data */
+struct tree_entry {
+	uint32_t mode;
+	const char *name;
+	size_t name_bytes;
+	const uint8_t *sha1;
+};
+
+struct cached_object;
+
+/* The tree object sha1 names, or the tree of the commit it names, from the
+ * object cache: give it back with object_cache_put() */
+const struct cached_object *tree_object_get(uint8_t *sha1, char **error);
+
+/* Parse the entry at *data and move past it. Returns 1 at end, -1 when the
+ * tree is corrupt. */
+int tree_entry_next(const uint8_t **data, const uint8_t *end,
+		struct tree_entry *entry);
+
+/* Order of the entries in trees, the one of the index: directories sort as
+ * if their name ended with a slash */
+int tree_entry_compare(const char *a, size_t a_bytes, int a_tree,
+		const char *b, size_t b_bytes, int b_tree);
+
+/* what diff-tree and diff-index show of the changes */
+#define TREE_DIFF_RAW			0
+#define TREE_DIFF_NAME_ONLY		1
+#define TREE_DIFF_NAME_STATUS	2
+
+/* The output of a walk comparing a tree with another tree or the index */
+struct tree_diff {
+	struct buffer out;
+	int output;
+	/* of the directory being compared, with a trailing slash */
+	char path[PATH_MAX];
+};
+
+/* the sha1 of a side the file is missing on */
+extern const uint8_t null_sha1[20];
+
+/* Show the change of the file at diff->path, a mode of 0 meaning it is
+ * missing on that side. The raw format is git's:
+ * ":<mode a> <mode b> <sha1 a> <sha1 b> <status>\t<path>" */
+int tree_diff_change(struct tree_diff *diff, size_t path_bytes,
+		uint32_t mode_a, const uint8_t *sha1_a,
+		uint32_t mode_b, const uint8_t *sha1_b);
+
+/* Append the entry's name to the path of its directory, returns the bytes
+ * of the path, 0 when too long */
+size_t tree_diff_path_append(struct tree_diff *diff, size_t prefix_bytes,
+		struct tree_entry *entry);
+
+size_t tree_cache_bytes(struct tree_cache *tree);
+uint8_t *tree_cache_serialize(struct tree_cache *tree, uint8_t *data);
+struct tree_cache *tree_cache_parse(const uint8_t *data, size_t bytes);
+
+#endif /* TREE_H */
@@ -1,11 +1,32 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "index.h"
 
-static int usage(const char *program, 
+/* Files are hashed, compressed and stored by a pool of workers while the main
+ * thread inserts the results in the index in the order the files were given,
+ * so that the output does not depend on the scheduling. */
+struct add_job {
+	const char *filename;
+	struct index_entry *entry;
+	char *error;
+	int done;
+};
+
+struct add_pool {
+	struct add_job *jobs;
+	size_t jobs_count;
+	size_t next;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static int usage(const char *program,
 		int return_value,
 		const char *message, ...)
 {
@@ -17,20 +38,176 @@ static int usage(const char *program,
 		va_end(ap);
 		fprintf(stderr, "\n");
 	}
-	fprintf(stderr, "usage: %s [--add|-a] [--help|-h] [--] <file>...\n", program);
+	fprintf(stderr, "usage: %s [--add|-a] [--help|-h] [--jobs|-j <n>] [--index-version <n>] [--refresh] [--] <file>...\n", program);
 
 	return return_value;
 }
 
+static void *add_worker(void *data)
+{
+	struct add_pool *pool = data;
+
+	for (;;) {
+		struct add_job *job;
+		struct index_entry *entry;
+		char *error = NULL;
+
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next == pool->jobs_count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		entry = index_entry_create(job->filename, &error);
+
+		pthread_mutex_lock(&pool->lock);
+		job->entry = entry;
+		job->error = error;
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static struct add_job *add_job_wait(struct add_pool *pool, size_t i)
+{
+	struct add_job *job = &pool->jobs[i];
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return job;
+}
+
+/* Hash and store the files, by a pool of workers when jobs > 1, then insert
+ * them in the index at once. Returns the number of files added. */
+static int files_add(struct index *index, const char **files, size_t count,
+		int jobs, int verbose)
+{
+	struct add_pool pool;
+	pthread_t *threads;
+	struct index_entry **entries;
+	size_t entries_count;
+	char *error;
+	size_t i;
+
+	if (count == 0)
+		return 0;
+	if (jobs > count)
+		jobs = count;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.jobs = calloc(count, sizeof(*pool.jobs));
+	threads = calloc(jobs, sizeof(*threads));
+	entries = calloc(count, sizeof(*entries));
+	if (!pool.jobs || !threads || !entries) {
+		fprintf(stderr, "calloc fail: %m\n");
+		free(pool.jobs);
+		free(threads);
+		free(entries);
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+		pool.jobs[i].filename = files[i];
+	pool.jobs_count = count;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	/* a single job runs in the main thread */
+	if (jobs < 2)
+		jobs = 0;
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, add_worker, &pool) != 0) {
+			fprintf(stderr, "pthread_create fail: %m\n");
+			break;
+		}
+	}
+	jobs = i;
+	/* without any worker, do the work ourselves */
+	if (jobs == 0)
+		add_worker(&pool);
+
+	entries_count = 0;
+	for (i = 0; i < count; i++) {
+		struct add_job *job = add_job_wait(&pool, i);
+
+		if (!job->entry) {
+			fprintf(stderr, "index_file_add '%s' fail: %s\n", job->filename, job->error);
+			free(job->error);
+			continue;
+		}
+		entries[entries_count++] = job->entry;
+		if (verbose)
+			fprintf(stdout, "%s %s\n", sha12hex(job->entry->sha1), job->filename);
+	}
+
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.jobs);
+
+	if (index_add_batch(index, entries, entries_count, &error) < 0) {
+		fprintf(stderr, "index_add_batch fail: %s\n", error);
+		free(error);
+		entries_count = 0;
+	}
+	free(entries);
+
+	return entries_count;
+}
+
+/* Refresh the stat data of every entry, report the ones whose content
+ * changed. Returns the number of such entries, or -1. */
+static int files_refresh(struct index *index)
+{
+	char *error;
+	int changed;
+	int result;
+	int i;
+
+	changed = 0;
+	for (i = 0; i < index->entries_count; i++) {
+		struct index_entry *entry = index->entries[i];
+
+		result = index_entry_refresh(index, i, &error);
+		if (result < 0) {
+			fprintf(stderr, "index_entry_refresh fail: %s\n", error);
+			free(error);
+			return -1;
+		}
+		if (result > 0) {
+			fprintf(stdout, "%.*s: needs update\n", entry->name_bytes, entry->name);
+			changed++;
+		}
+	}
+
+	return changed;
+}
+
 int main(int argc, char *argv[])
 {
 	int add;
+	int changed;
 	int i;
+	int jobs;
+	long value;
+	char *end;
+	int refresh;
 	int stop_options;
 	int verbose;
-	struct index *index;	
-	uint8_t sha1[20];
+	int version;
+	struct index *index;
 	char *error;
+	const char **files;
+	size_t files_count;
 
 	if (argc < 2)
 		return usage(argv[0], 1, NULL);
@@ -42,7 +219,15 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	add = stop_options = verbose = 0;
+	files = calloc(argc, sizeof(*files));
+	if (!files) {
+		fprintf(stderr, "calloc fail: %m\n");
+		return 1;
+	}
+	files_count = 0;
+
+	add = refresh = stop_options = verbose = version = 0;
+	jobs = 1;
 	for (i = 1; i < argc; i++) {
 		const char *arg = argv[i];
 
@@ -61,6 +246,32 @@ int main(int argc, char *argv[])
 				verbose = 1;
 				continue;
 			}
+			if (!strncmp(arg, "--jobs", sizeof("--jobs")) ||
+					!strncmp(arg, "-j", sizeof("-j"))) {
+				if (i + 1 == argc)
+					return usage(argv[0], 1, "missing number of jobs");
+				/* 0 means one job per online cpu */
+				value = strtol(argv[++i], &end, 10);
+				if (end == argv[i] || *end || value < 0 || value > INT_MAX)
+					return usage(argv[0], 1, "invalid number of jobs '%s'",
+							argv[i]);
+				jobs = value;
+				if (!jobs)
+					jobs = sysconf(_SC_NPROCESSORS_ONLN);
+				continue;
+			}
+			if (!strncmp(arg, "--index-version", sizeof("--index-version"))) {
+				if (i + 1 == argc)
+					return usage(argv[0], 1, "missing index version");
+				version = atoi(argv[++i]);
+				if (version != GT_VERSION && version != GT_VERSION_2)
+					return usage(argv[0], 1, "unknown index version '%s'", argv[i]);
+				continue;
+			}
+			if (!strncmp(arg, "--refresh", sizeof("--refresh"))) {
+				refresh = 1;
+				continue;
+			}
 			if (!strncmp(arg, "--", sizeof("--"))) {
 				stop_options = 1;
 				continue;
@@ -73,19 +284,41 @@ int main(int argc, char *argv[])
 		if (!add)
 			return usage(argv[0], 1, "An action must be provided (--add|-a)");
 
-		if (index_file_add(index, arg, sha1, &error) < 0) {
-			fprintf(stderr, "index_file_add '%s' fail: %s\n", arg, error);
-			free(error);
-			continue;
-		}
-		add++;
-		if (verbose)
-			fprintf(stdout, "%s %s\n", sha12hex(sha1), arg);
+		files[files_count++] = arg;
+	}
+
+	/* converted when written back */
+	if (version)
+		index->version = version;
+
+	index_monitor_begin(index);
+	object_batch_begin();
+	add += files_add(index, files, files_count, jobs, verbose);
+	free(files);
+	/* the stat data refreshed is written back even when some changed */
+	changed = 0;
+	if (refresh)
+		changed = files_refresh(index);
+
+	/* the index must not refer to objects which could still be lost */
+	if (object_batch_end(&error) < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
 	}
 
-	index_close(index, &error);
+	if (index_close(index, &error) < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
 
-	if (add < 2)
+	/* 1 is kept for files which need an update */
+	if (refresh && changed < 0)
+		return 2;
+	if (refresh)
+		return changed != 0;
+	if (add < 2 && !version)
 		return usage(argv[0], 1, "you must provide a file to add");
 
 	return 0;
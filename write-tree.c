@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
@@ -22,35 +23,119 @@ static int usage(const char *program,
 	return return_value;
 }
 
-int tree_write(struct index *index, uint8_t *sha1, char **error)
+/* Write the tree of the directory prefix, made of the index entries from
+ * *position on, using and updating its cache node. */
+static int tree_write_directory(struct index *index, int *position,
+		const char *prefix, size_t prefix_bytes, struct tree_cache *tree,
+		int *updated, char **error)
 {
+	struct tree_cache **subtrees;
+	uint32_t subtrees_count;
+	int start;
 	int i;
-	size_t tree_size;
-	char ascii_size[16];
-	size_t offset;
-	size_t prefix_bytes;
 	DECLARE_BUFFER(buffer);
 
-	buffer_init(&buffer);
-	offset = sizeof("tree ") + sizeof(ascii_size) + 1;
-	buffer_seek(&buffer, offset);
-	for (i = 0; i < index->entries_count; i++) {
-		struct index_entry *entry = index->entries[i];
+	if (tree->entries_count >= 0 &&
+			*position + tree->entries_count <= index->entries_count) {
+		*position += tree->entries_count;
+		return 0;
+	}
+
+	/* only keep the subtrees still in the index */
+	subtrees = calloc(tree->subtrees_count + 1, sizeof(*subtrees));
+	if (!subtrees) {
+		asprintf(error, "calloc fail: %m");
+		return -1;
+	}
+	subtrees_count = 0;
 
-		buffer_sprintf(&buffer, "%o %.*s", entry->st_mode, entry->name_bytes, entry->name);
+	buffer_init(&buffer);
+	start = *position;
+	while (*position < index->entries_count) {
+		struct index_entry *entry = index->entries[*position];
+		struct tree_cache *subtree;
+		const char *name;
+		const char *slash;
+		size_t name_bytes;
+		void *ptr;
+
+		if (entry->name_bytes <= prefix_bytes ||
+				memcmp(entry->name, prefix, prefix_bytes))
+			break;
+		name = entry->name + prefix_bytes;
+		name_bytes = entry->name_bytes - prefix_bytes;
+		slash = memchr(name, '/', name_bytes);
+		if (!slash) {
+			buffer_sprintf(&buffer, "%o %.*s", entry->st_mode, (int) name_bytes, name);
+			buffer_concat(&buffer, "\0", 1);
+			buffer_concat(&buffer, entry->sha1, sizeof(entry->sha1));
+			(*position)++;
+			continue;
+		}
+
+		name_bytes = slash - name;
+		subtree = tree_cache_subtree(tree, name, name_bytes, 1);
+		ptr = realloc(subtrees, (subtrees_count + 1) * sizeof(*subtrees));
+		if (!subtree || !ptr) {
+			asprintf(error, "alloc fail: %m");
+			goto fail;
+		}
+		subtrees = ptr;
+		subtrees[subtrees_count++] = subtree;
+		if (tree_write_directory(index, position, entry->name,
+					slash + 1 - entry->name, subtree, updated, error) < 0)
+			goto fail;
+		buffer_sprintf(&buffer, "%o %.*s", TREE_MODE, (int) name_bytes, name);
 		buffer_concat(&buffer, "\0", 1);
-		buffer_concat(&buffer, entry->sha1, sizeof(entry->sha1));
+		buffer_concat(&buffer, subtree->sha1, sizeof(subtree->sha1));
 	}
 
-	tree_size = buffer.data_bytes - offset;
-	sprintf(ascii_size, "%ld", tree_size);
-	prefix_bytes = strlen(ascii_size) + sizeof("tree ");
-	offset -= prefix_bytes;
-	buffer_seek(&buffer, offset);
-	buffer_sprintf(&buffer, "tree %ld", tree_size);
+	if (object_hash(buffer.data, buffer.data_bytes, "tree", 1, tree->sha1,
+				error) < 0)
+		goto fail;
+	buffer_uninit(&buffer);
+
+	for (i = 0; i < tree->subtrees_count; i++) {
+		int j;
+
+		for (j = 0; j < subtrees_count; j++) {
+			if (subtrees[j] == tree->subtrees[i])
+				break;
+		}
+		if (j == subtrees_count)
+			tree_cache_free(tree->subtrees[i]);
+	}
+	free(tree->subtrees);
+	tree->subtrees = subtrees;
+	tree->subtrees_count = subtrees_count;
+	tree->entries_count = *position - start;
+	*updated = 1;
+
+	return 0;
 
-	file_sha1_write(buffer.data + offset, tree_size + prefix_bytes, sha1, error);
+fail:
 	buffer_uninit(&buffer);
+	free(subtrees);
+	return -1;
+}
+
+int tree_write(struct index *index, uint8_t *sha1, int *updated, char **error)
+{
+	int position;
+
+	if (!index->tree) {
+		index->tree = tree_cache_create("", 0);
+		if (!index->tree) {
+			asprintf(error, "calloc fail: %m");
+			return -1;
+		}
+	}
+
+	position = 0;
+	if (tree_write_directory(index, &position, "", 0, index->tree, updated,
+				error) < 0)
+		return -1;
+	memcpy(sha1, index->tree->sha1, 20);
 
 	return 0;
 }
@@ -61,6 +146,7 @@ int main(int argc, char *argv[])
 	char *error;
 	struct index *index;
 	uint8_t sha1[20];
+	int updated;
 
 	index = index_open(&error);
 	if (!index) {
@@ -80,15 +166,25 @@ int main(int argc, char *argv[])
 			return usage(argv[0], 1, "Unknown option '%s'", arg);
 	}
 
-	if (tree_write(index, sha1, &error) < 0) {
-		fprintf(stderr, "%s", error);
+	updated = 0;
+	if (tree_write(index, sha1, &updated, &error) < 0) {
+		fprintf(stderr, "%s\n", error);
 		free(error);
 		return 1;
 	}
 
 	fprintf(stdout, "%s\n", sha12hex(sha1));
 
-	index_close(index, &error);
+	/* save the tree cache, when it changed */
+	if (!updated) {
+		index_free(index);
+		return 0;
+	}
+	if (index_close(index, &error) < 0) {
+		fprintf(stderr, "%s\n", error);
+		free(error);
+		return 1;
+	}
 
 	return 0;
 }